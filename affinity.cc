@@ -0,0 +1,351 @@
+//===================================================================
+// File:        affinity.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Thread placement and real-time scheduling
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "affinity.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+
+Affinity Affinity::aff;
+
+
+inline static std::string TASK_STAT(pid_t tid)
+{
+	std::ostringstream p;
+
+	p << "/proc/self/task/" << tid << "/stat";
+
+	FILE *f = fopen(p.str().c_str(), "r");
+
+	if(f == NULL)
+		return "";
+
+	char buf[1024];
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+
+	fclose(f);
+
+	buf[n] = '\0';
+
+	return buf;
+}
+
+// Field 39 of the task's stat, counted past the parenthesised name.
+inline static int LAST_CPU(pid_t tid)
+{
+	std::string s = TASK_STAT(tid);
+	size_t p = s.rfind(')');
+
+	if(p == std::string::npos)
+		return -1;
+
+	std::istringstream ss(s.substr(p + 1));
+	std::string f;
+
+	for(int i = 3; i <= 39; ++i)
+		if(!(ss >> f))
+			return -1;
+
+	return atoi(f.c_str());
+}
+
+
+Affinity::Affinity()
+:
+	prio(0), loop(0), entered(false), locked(false), err("")
+{
+	pthread_mutex_init(&lock, NULL);
+
+	CPU_ZERO(&rest);
+}
+
+Affinity::~Affinity()
+{
+}
+
+Affinity & Affinity::instance()
+{
+	return aff;
+}
+
+bool Affinity::fail(const char *what)
+{
+	err = std::string("Affinity(): ") + what + "(): " + strerror(errno);
+
+	return false;
+}
+
+const std::string & Affinity::error() const
+{
+	return err;
+}
+
+int Affinity::node(int cpu)
+{
+	if(cpu < 0)
+		return -1;
+
+	std::ostringstream p;
+
+	p << "/sys/devices/system/cpu/cpu" << cpu;
+
+	DIR *d = opendir(p.str().c_str());
+
+	if(d == NULL)
+		return -1;
+
+	int n = -1;
+
+	for(dirent *e; n == -1 && (e = readdir(d)) != NULL;)
+		if(!strncmp(e->d_name, "node", 4) && isdigit(e->d_name[4]))
+			n = atoi(e->d_name + 4);
+
+	closedir(d);
+
+	return n;
+}
+
+// Cores must be among those the process may run on, the others keep
+// what is left of that set.
+bool Affinity::setCores(const char *list)
+{
+	cpu_set_t allowed;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		return fail("sched_getaffinity");
+
+	std::istringstream ss(list);
+	std::string item;
+
+	cores.clear();
+	rest = allowed;
+
+	while(std::getline(ss, item, ','))
+	{
+		char *end;
+		long lo = strtol(item.c_str(), &end, 10), hi = lo;
+
+		if(*end == '-')
+			hi = strtol(end + 1, &end, 10);
+
+		if(item.empty() || *end || lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+		{
+			err = "Affinity(): bad core list `" + std::string(list) + "'";
+			return false;
+		}
+
+		for(long c = lo; c <= hi; ++c)
+		{
+			if(!CPU_ISSET(c, &allowed))
+			{
+				std::ostringstream e;
+
+				e << "Affinity(): core " << c << " not available";
+				err = e.str();
+
+				return false;
+			}
+
+			cores.push_back(c);
+			CPU_CLR(c, &rest);
+		}
+	}
+
+	if(CPU_COUNT(&rest) == 0) 				// no core to spare
+		rest = allowed;
+
+	return true;
+}
+
+void Affinity::setRealtime(int priority)
+{
+	prio = priority;
+}
+
+void Affinity::setLoop(size_t workers)
+{
+	loop = workers;
+}
+
+bool Affinity::lockMemory()
+{
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		return fail("mlockall");
+
+	locked = true;
+
+	return true;
+}
+
+int Affinity::core(size_t thread) const
+{
+	return cores.empty() ? -1 : cores[thread % cores.size()];
+}
+
+int Affinity::coreOf(size_t producer) const
+{
+	return core(loop ? producer % loop : producer);
+}
+
+// The kernel allocates ring memory on the node of the calling CPU, user
+// memory on the node of the first touch.
+void Affinity::enter(int core)
+{
+	if(core < 0 || entered)
+		return;
+
+	cpu_set_t s;
+
+	CPU_ZERO(&s);
+	CPU_SET(core, &s);
+
+	if(sched_getaffinity(0, sizeof(saved), &saved) == -1
+			|| sched_setaffinity(0, sizeof(s), &s) == -1)
+		return;
+
+	entered = true;
+}
+
+void Affinity::leave()
+{
+	if(!entered)
+		return;
+
+	sched_setaffinity(0, sizeof(saved), &saved);
+
+	entered = false;
+}
+
+void Affinity::enroll(const std::string &name, int core)
+{
+	Thread t;
+
+	t.name = name;
+	t.handle = pthread_self();
+	t.tid = syscall(SYS_gettid);
+	t.core = core;
+
+	pthread_setname_np(t.handle, name.substr(0, 15).c_str());
+
+	pthread_mutex_lock(&lock);
+
+	threads.push_back(t);
+
+	pthread_mutex_unlock(&lock);
+}
+
+// Failures leave the thread where it is, stat shows what it got.
+void Affinity::place(size_t thread, const std::string &name)
+{
+	int c = core(thread);
+	int rc;
+
+	if(c >= 0)
+	{
+		cpu_set_t s;
+
+		CPU_ZERO(&s);
+		CPU_SET(c, &s);
+
+		if((rc = pthread_setaffinity_np(pthread_self(), sizeof(s), &s)))
+			std::cerr << "WARNING: Affinity(): " << name << ": " << strerror(rc)
+				<< std::endl;
+	}
+
+	if(prio)
+	{
+		sched_param sp;
+
+		sp.sched_priority = prio;
+
+		if((rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)))
+			std::cerr << "WARNING: Affinity(): " << name << ": SCHED_FIFO: "
+				<< strerror(rc) << std::endl;
+	}
+
+	enroll(name, c);
+}
+
+void Affinity::place(const std::string &name)
+{
+	if(!cores.empty())
+		pthread_setaffinity_np(pthread_self(), sizeof(rest), &rest);
+
+	enroll(name, -1);
+}
+
+// Read back from the kernel: the CPU each thread last ran on and its
+// scheduling policy.
+std::ostream & operator <<(std::ostream &os, const Affinity &a)
+{
+	os << "Thread\t\tCore\tCPU\tNode\tPolicy";
+
+	pthread_mutex_lock(&a.lock);
+
+	for(size_t i = 0; i < a.threads.size(); ++i)
+	{
+		const Affinity::Thread &t = a.threads[i];
+
+		int cpu = LAST_CPU(t.tid);
+		int policy;
+		sched_param sp;
+
+		os << std::endl << t.name << (t.name.size() < 8 ? "\t\t" : "\t");
+
+		if(t.core < 0) os << "-";
+		else os << t.core;
+
+		os << "\t" << cpu << "\t" << Affinity::node(cpu) << "\t";
+
+		if(pthread_getschedparam(t.handle, &policy, &sp))
+			os << "?";
+		else if(policy == SCHED_FIFO)
+			os << "fifo/" << sp.sched_priority;
+		else
+			os << "other";
+	}
+
+	pthread_mutex_unlock(&a.lock);
+
+	os << std::endl << "-- Memory " << (a.locked ? "locked" : "not locked")
+		<< " --";
+
+	return os;
+}
@@ -0,0 +1,101 @@
+//===================================================================
+// File:        affinity.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Thread placement and real-time scheduling
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+
+// Where the switch threads run. Forwarding threads take the cores of the
+// map in turn and, in real-time mode, SCHED_FIFO; every other thread
+// stays off those cores. Drivers are created on the core of the thread
+// that first receives from them, so their rings are allocated on its
+// NUMA node.
+class Affinity
+{
+private:
+	static Affinity aff;
+private:
+	struct Thread
+	{
+		std::string name;
+		pthread_t handle;
+		pid_t tid;
+		int core; 											// requested, -1 if none
+	};
+private:
+	std::vector<int> cores; 					// by forwarding thread
+	cpu_set_t rest; 									// all but the map
+	int prio; 												// SCHED_FIFO, 0 if off
+	size_t loop; 											// event-loop workers, 0 if none
+	cpu_set_t saved; 									// before enter()
+	bool entered;
+	bool locked;
+	mutable pthread_mutex_t lock;
+	std::vector<Thread> threads;
+	std::string err;
+private:
+	Affinity();
+	bool fail(const char *what);
+	void enroll(const std::string &name, int core);
+public:
+	static Affinity & instance();
+	static int node(int cpu); 				// -1 if unknown
+public:
+	~Affinity();
+public: 	// init //
+	bool setCores(const char *list); 	// "2,4-7"
+	void setRealtime(int priority);
+	void setLoop(size_t workers);
+	bool lockMemory(); 								// mlockall()
+	const std::string & error() const;
+
+	int core(size_t thread) const; 		// -1 if not pinned
+	int coreOf(size_t producer) const; 	// of the receiver's first thread
+
+	void enter(int core); 						// run there, -1 stays
+	void leave();
+public: 	// concurrent //
+	void place(size_t thread, const std::string &name); 	// forwarding
+	void place(const std::string &name);
+
+	friend std::ostream & operator <<(std::ostream &os, const Affinity &a);
+};
+
+
+#endif /* _AFFINITY_H_ */
@@ -0,0 +1,224 @@
+//===================================================================
+// File:        bench.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    CAM lookup and port backend benchmarks
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "mac.h"
+#include "port.h"
+#include "cam.h"
+#include "driver.h"
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sys/time.h>
+
+
+#define BENCH_LOOKUPS 							(1 << 24)
+#define BENCH_SECONDS 							2
+
+
+using namespace std;
+
+
+class NullPort : public Port
+{
+public:
+	void send(const u_int8_t *, size_t, const Port *) {}
+	void send(const u_int8_t *, size_t) {}
+
+	const char *name() const { return "null"; }
+};
+
+
+inline static double NOW()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+inline static MACAddr ADDR(u_int32_t n)
+{
+	u_int8_t a[6] = { 0x02, 0x00, (u_int8_t)(n >> 24), (u_int8_t)(n >> 16),
+		(u_int8_t)(n >> 8), (u_int8_t)n };
+
+	return MACAddr(a);
+}
+
+static void bench(CAMTable &cam, vector<NullPort> &ports, size_t size)
+{
+	if(!cam.setCapacity(size, 0))
+	{
+		cerr << "ERROR: Cannot allocate " << size << " entries" << endl;
+		return;
+	}
+
+	vector<CAMLearn> l(size);
+
+	for(size_t i = 0; i < size; ++i)
+	{
+		l[i].mac = ADDR(i);
+		l[i].port = &ports[i % ports.size()];
+	}
+
+	for(size_t i = 0; i < size; i += CAM_BATCH)
+		cam.learnBatch(&l[i], size - i < CAM_BATCH ? size - i : CAM_BATCH);
+
+	vector<MACAddr> mac(BENCH_LOOKUPS);
+	vector<Port *> out(BENCH_LOOKUPS);
+
+	for(size_t i = 0; i < mac.size(); ++i)
+		mac[i] = ADDR(rand() % size);
+
+	double t = NOW();
+
+	for(size_t i = 0; i < mac.size(); ++i)
+		out[i] = cam.find(mac[i]);
+
+	double single = NOW() - t;
+
+	t = NOW();
+
+	for(size_t i = 0; i < mac.size(); i += CAM_BATCH)
+		cam.findBatch(&mac[i], &out[i], CAM_BATCH);
+
+	double batch = NOW() - t;
+
+	for(size_t i = 0; i < mac.size(); ++i)
+		if(out[i] == NULL) 	// no default port
+		{
+			cerr << "ERROR: Lookup failed" << endl;
+			return;
+		}
+
+	cout << size << " entries: "
+		<< (size_t)(mac.size() / single) << " single, "
+		<< (size_t)(mac.size() / batch) << " batched lookups/s" << endl;
+}
+
+static volatile bool blasting;
+
+static void * blast(void *data)
+{
+	Driver *out = (Driver *)data;
+
+	u_int8_t f[60];
+	Frame b[RX_BURST];
+
+	memset(f, 0xFF, 6);
+	memset(f + 6, 0x02, sizeof(f) - 6);
+
+	for(size_t i = 0; i < RX_BURST; ++i)
+	{
+		b[i].data = f;
+		b[i].len = sizeof(f);
+		b[i].ref = NULL;
+	}
+
+	while(blasting)
+		out->send(b, RX_BURST);
+
+	return NULL;
+}
+
+// Frames received per second on rx with the given backend while tx is
+// flooded through AF_PACKET, a veth pair will do.
+static void bench(const char *tx, const char *rx, const char *type)
+{
+	DriverConfig rc, tc;
+
+	rc.type = type;
+	tc.type = "packet";
+
+	Driver *in, *out;
+
+	try
+	{
+		in = Driver::create(rx, rc);
+		out = Driver::create(tx, tc);
+	}
+	catch(const std::string &str)
+	{
+		cerr << "ERROR: " << type << ": " << str << endl;
+		return;
+	}
+
+	Frame f[RX_BURST];
+	unsigned long frames = 0, calls = 0;
+
+	pthread_t thr;
+
+	blasting = true;
+
+	pthread_create(&thr, NULL, blast, out);
+
+	double t = NOW(), end = t + BENCH_SECONDS;
+
+	while(NOW() < end)
+	{
+		frames += in->recv(f, RX_BURST);
+		++calls;
+	}
+
+	t = NOW() - t;
+
+	blasting = false;
+
+	pthread_join(thr, NULL);
+
+	cout << type << ": " << (size_t)(frames / t) << " frames/s, "
+		<< (calls ? frames / calls : 0) << " frames/recv" << endl;
+
+	delete out;
+	delete in;
+}
+
+int main(int argc, char **argv)
+{
+	CAMTable &cam = CAMTable::instance();
+	vector<NullPort> ports(16);
+
+	bench(cam, ports, 1 << 10);
+	bench(cam, ports, 1 << 16);
+	bench(cam, ports, 1 << 20);
+
+	if(argc == 3) 										// bench TX-IFACE RX-IFACE
+	{
+		const char *type[] = { "pcap", "packet", "uring", "xdp" };
+
+		for(size_t i = 0; i < sizeof(type) / sizeof(type[0]); ++i)
+			bench(argv[1], argv[2], type[i]);
+	}
+
+	return 0;
+}
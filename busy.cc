@@ -0,0 +1,113 @@
+//===================================================================
+// File:        busy.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Busy-poll receive with adaptive backoff
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "busy.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <ctime>
+
+
+inline static u_int64_t NSEC()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+PollStats::PollStats()
+:
+	polls(0), empty(0), yields(0), sleeps(0), work(0), spin(0), yield(0),
+	sleep(0)
+{
+}
+
+
+BusyPoll::BusyPoll(PollStats &s)
+:
+	st(s), idle(0), nap(1), t(NSEC())
+{
+}
+
+// The time since the last call went into the poll and, with frames, into
+// forwarding them.
+void BusyPoll::polled(size_t frames)
+{
+	u_int64_t now = NSEC();
+
+	++st.polls;
+
+	if(frames)
+	{
+		st.work += now - t;
+		t = now;
+
+		idle = 0;
+		nap = 1;
+
+		return;
+	}
+
+	++st.empty;
+	st.spin += now - t;
+	t = now;
+
+	if(idle <= POLL_SPINS + POLL_YIELDS)
+		++idle;
+
+	if(idle <= POLL_SPINS)
+		return;
+
+	if(idle <= POLL_SPINS + POLL_YIELDS)
+	{
+		sched_yield();
+
+		++st.yields;
+		now = NSEC();
+		st.yield += now - t;
+	}
+	else
+	{
+		usleep(nap);
+
+		if(nap < POLL_SLEEP_MAX)
+			nap = nap * 2 < POLL_SLEEP_MAX ? nap * 2 : POLL_SLEEP_MAX;
+
+		++st.sleeps;
+		now = NSEC();
+		st.sleep += now - t;
+	}
+
+	t = now;
+}
@@ -0,0 +1,80 @@
+//===================================================================
+// File:        busy.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Busy-poll receive with adaptive backoff
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _BUSY_H_
+#define _BUSY_H_
+
+
+#include <sys/types.h>
+
+
+#if POLL_SPINS <= 0
+# 	define POLL_SPINS 								2048 	// empty polls before yielding
+#endif
+
+#if POLL_YIELDS <= 0
+# 	define POLL_YIELDS 								64 		// yields before sleeping
+#endif
+
+#if POLL_SLEEP_MAX <= 0
+# 	define POLL_SLEEP_MAX 						1000 	// us, sleeps double up to it
+#endif
+
+
+// Where a busy-polling receiver spends its time, in ns. Only its thread
+// writes it.
+struct PollStats
+{
+	unsigned long polls, empty;
+	unsigned long yields, sleeps;
+	u_int64_t work, spin, yield, sleep;
+
+	PollStats();
+};
+
+// Paces a busy-polling receiver. After an empty poll it polls again at
+// once for POLL_SPINS polls, then yields the core between polls for
+// POLL_YIELDS more, then sleeps between them, twice as long each time.
+// A poll with frames starts over. Costs a clock read per poll.
+class BusyPoll
+{
+private:
+	PollStats &st;
+	unsigned idle; 										// empty polls in a row
+	unsigned nap; 										// us
+	u_int64_t t;
+public:
+	BusyPoll(PollStats &s);
+
+	void polled(size_t frames); 			// after each poll, may back off
+};
+
+
+#endif /* _BUSY_H_ */
@@ -29,6 +29,9 @@
 
 
 #include "cam.h"
+#include "epoch.h"
+
+#include <sys/mman.h>
 
 #include <iomanip>
 #include <cstring>
@@ -38,16 +41,95 @@
 CAMTable CAMTable::cam;
 
 
+inline static MACAddr KEY_MAC(u_int64_t key)
+{
+	u_int8_t a[MACAddr::LENGTH];
+
+	for(size_t i = MACAddr::LENGTH; i > 0; --i, key >>= 8)
+		a[i - 1] = key & 0xFF;
+
+	return MACAddr(a);
+}
+
+inline static u_int64_t WORD_KEY(u_int64_t word)
+{
+	return word >> 16;
+}
+
+inline static u_int16_t WORD_PORT(u_int64_t word)
+{
+	return word & 0xFFFF;
+}
+
+inline static u_int64_t SLOT_TAG(u_int64_t key)
+{
+	return key << 32; 								// low MAC bytes, entry is checked anyway
+}
+
+inline static size_t SLOT_ENTRY(u_int64_t slot)
+{
+	return slot & 0xFFFFFFFF;
+}
+
+inline static size_t SLOT_HOME(u_int64_t key, size_t mask)
+{
+	return ((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+inline static size_t SLOTS(size_t entries) 		// load factor <= 0.5
+{
+	size_t slots = CACHE_LINE / sizeof(u_int64_t);
+
+	while(slots < 2 * entries)
+		slots <<= 1;
+
+	return slots;
+}
+
+inline static bool WHEEL_HEAD(u_int32_t prev) 	// prev is a wheel slot
+{
+	return prev & 0x80000000;
+}
+
+inline static bool ACTIVE(u_int16_t mark, time_t now) 	// hold not over
+{
+	return (int16_t)(mark - (u_int16_t)now) > 0;
+}
+
+inline static void * MAP(size_t bytes) 				// zeroed, page aligned
+{
+	void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(p == MAP_FAILED) return NULL;
+
+	return p;
+}
+
+
 CAMTable::CAMTable()
+:
+	segs(NULL), nsegs(0), maxSegs(0), capacity(0), used(0), budget(0),
+	freeHead(0), index(NULL), old(NULL), migrated(0), migrateEnd(0),
+	defPort(NULL), nports(0), wheelTime(0), hand(0), handTime(0),
+	flaps(0), evicted(0), refused(0), mirror(NULL), gen(0)
 {
-	memset(table, 0, sizeof(table));
+	pthread_mutex_init(&lock, NULL);
 
-	pthread_rwlock_init(&lock, NULL);
+	memset(ports, 0, sizeof(ports));
+	memset(portState, 0, sizeof(portState));
+	memset(wheel, 0, sizeof(wheel));
 
 	setMinTTL(DEFAULT_MIN_TTL);
+	setPolicy(LRU);
+	setDamping(DEFAULT_FLAP_MOVES, DEFAULT_FLAP_WINDOW, DEFAULT_FLAP_HOLD, false);
+	setPortLimit(0, 0, DROP_LEARN);
+	setCapacity(CAM_TABLE_SIZE, 0);
+}
 
-	for(size_t i = 1; i <= CAM_TABLE_SIZE; ++i)
-		free.push(i);
+CAMTable::~CAMTable()
+{
+	release();
 }
 
 CAMTable & CAMTable::instance()
@@ -55,54 +137,799 @@ CAMTable & CAMTable::instance()
 	return cam;
 }
 
-void CAMTable::setMinTTL(unsigned sec)
+CAMTable::Index * CAMTable::newIndex(size_t slots)
 {
-	minTTL = sec;
+	u_int64_t *s = (u_int64_t *)MAP(slots * sizeof(u_int64_t));
+
+	if(s == NULL) return NULL;
+
+	Index *ix = new Index;
+
+	ix->slot = s;
+	ix->mask = slots - 1;
+
+	return ix;
 }
 
-void CAMTable::setDefaultPort(Port *p)
+void CAMTable::freeIndex(void *ix)
 {
-	table[0].port = p;
+	Index *i = (Index *)ix;
+
+	munmap(i->slot, (i->mask + 1) * sizeof(u_int64_t));
+
+	delete i;
 }
 
-void CAMTable::insert(const MACAddr &mac, Port *p)
+void CAMTable::release()
 {
-	if(mac.isBroadcast()) return;
+	for(size_t i = 0; i < nsegs; ++i)
+		munmap(segs[i], CAM_SEGMENT * sizeof(Entry));
+
+	delete [] segs;
 
-	pthread_rwlock_wrlock(&lock);
+	if(index) freeIndex(index);
+	if(old) freeIndex(old);
 
-	if(free.empty()) 				// full table
+	segs = NULL;
+	index = old = NULL;
+	nsegs = maxSegs = capacity = used = 0;
+	freeHead = 0;
+	evicted = refused = 0;
+
+	memset(wheel, 0, sizeof(wheel));
+}
+
+// Writer lock held, after the change is visible.
+inline void CAMTable::bump()
+{
+	__atomic_store_n(&gen, gen + 1, __ATOMIC_RELEASE);
+}
+
+inline CAMTable::Entry & CAMTable::entry(size_t i) const
+{
+	return segs[i / CAM_SEGMENT][i & (CAM_SEGMENT - 1)];
+}
+
+size_t CAMTable::footprint(size_t segs)
+{
+	return segs * CAM_SEGMENT * sizeof(Entry)
+		+ SLOTS(segs * CAM_SEGMENT) * sizeof(u_int64_t);
+}
+
+size_t CAMTable::memory() const
+{
+	size_t slots = index->mask + 1;
+
+	if(old) slots += old->mask + 1;
+
+	return nsegs * CAM_SEGMENT * sizeof(Entry) + slots * sizeof(u_int64_t);
+}
+
+// Writer lock held. Numbers are never reused, readers map them back
+// through ports[] without locking.
+u_int16_t CAMTable::portNumber(Port *p)
+{
+	for(size_t n = 1; n <= nports; ++n)
+		if(ports[n] == p) return n;
+
+	if(nports + 1 >= CAM_PORTS)
+		return 0;
+
+	__atomic_store_n(&ports[nports + 1], p, __ATOMIC_RELEASE);
+	__atomic_store_n(&nports, nports + 1, __ATOMIC_RELEASE);
+
+	return nports;
+}
+
+// Lock-free, 0 if the port has never learned.
+u_int16_t CAMTable::portNumber(const Port *p) const
+{
+	size_t n = __atomic_load_n(&nports, __ATOMIC_ACQUIRE);
+
+	for(; n > 0; --n)
+		if(__atomic_load_n(&ports[n], __ATOMIC_RELAXED) == p)
+			return n;
+
+	return 0;
+}
+
+// Lock-free, counters are read relaxed.
+bool CAMTable::overLimit(u_int16_t pn, time_t now) const
+{
+	const PortState &ps = portState[pn];
+
+	if(portMax && __atomic_load_n(&ps.used, __ATOMIC_RELAXED) >= portMax)
+		return true;
+
+	return portRate && __atomic_load_n(&ps.second, __ATOMIC_RELAXED)
+		== (u_int32_t)now && __atomic_load_n(&ps.learns, __ATOMIC_RELAXED)
+		>= portRate;
+}
+
+// Writer lock held. Accounts one learn on port pn, false if refused. A
+// shut down port learns nothing and starts afresh once enabled again.
+bool CAMTable::admit(u_int16_t pn, time_t now)
+{
+	PortState &ps = portState[pn];
+
+	if(ports[pn]->isDown())
+		return false;
+
+	if(overLimit(pn, now))
+	{
+		++ps.refused;
+		++refused;
+
+		if(portLimit == SHUTDOWN)
+		{
+			ports[pn]->setDown(true);
+			flush(pn);
+		}
+
+		return false;
+	}
+
+	if(ps.second != (u_int32_t)now)
+	{
+		__atomic_store_n(&ps.second, (u_int32_t)now, __ATOMIC_RELAXED);
+		__atomic_store_n(&ps.learns, 0, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&ps.learns, ps.learns + 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+// Lock-free. A concurrent unplace() may shift the entry behind the probe,
+// the miss is then handled as an unknown address (flood).
+size_t CAMTable::lookup(const Index *ix, u_int64_t key, u_int64_t *word) const
+{
+	u_int64_t tag = SLOT_TAG(key);
+
+	for(size_t s = SLOT_HOME(key, ix->mask);; s = (s + 1) & ix->mask)
 	{
-		camlookup_t::const_iterator it = lookup.find(mac);
+		u_int64_t v = __atomic_load_n(&ix->slot[s], __ATOMIC_ACQUIRE);
+
+		if(!v) return 0;
+
+		if((v & ~0xFFFFFFFFULL) != tag)
+			continue;
+
+		size_t i = SLOT_ENTRY(v);
+
+		u_int64_t w = __atomic_load_n(&entry(i).word, __ATOMIC_ACQUIRE);
 
-		if(it != lookup.end())
+		if(WORD_KEY(w) == key && WORD_PORT(w))
 		{
-			size_t i = it->second;
+			*word = w;
+			return i;
+		}
+	}
+}
+
+// Lock-free. While rehashing, an address is in the new index, the old
+// one or both. The new index is published after the old one is set.
+size_t CAMTable::lookup(u_int64_t key, u_int64_t *word) const
+{
+	size_t i = lookup(__atomic_load_n(&index, __ATOMIC_ACQUIRE), key, word);
+
+	if(i) return i;
+
+	const Index *o = __atomic_load_n(&old, __ATOMIC_ACQUIRE);
 
-			table[i].port = p; 	// avoid port flapping
-			table[i].timeStamp = time(NULL);
+	if(o == NULL) return 0;
+
+	return lookup(o, key, word);
+}
+
+// Writer lock held.
+void CAMTable::place(Index *ix, u_int64_t key, size_t i)
+{
+	size_t s = SLOT_HOME(key, ix->mask);
+
+	while(ix->slot[s])
+		s = (s + 1) & ix->mask;
+
+	__atomic_store_n(&ix->slot[s], SLOT_TAG(key) | i, __ATOMIC_RELEASE);
+}
+
+// Writer lock held. Backward shift deletion, keeps probe chains short
+// without tombstones.
+bool CAMTable::unplace(Index *ix, u_int64_t key)
+{
+	size_t s = SLOT_HOME(key, ix->mask);
+
+	for(;; s = (s + 1) & ix->mask)
+	{
+		if(!ix->slot[s])
+			return false;
+
+		if(WORD_KEY(entry(SLOT_ENTRY(ix->slot[s])).word) == key)
+			break;
+	}
+
+	for(size_t j = (s + 1) & ix->mask; ix->slot[j]; j = (j + 1) & ix->mask)
+	{
+		size_t home = SLOT_HOME(WORD_KEY(entry(SLOT_ENTRY(ix->slot[j])).word),
+				ix->mask);
+
+		if(((j - home) & ix->mask) >= ((j - s) & ix->mask))
+		{
+			__atomic_store_n(&ix->slot[s], ix->slot[j], __ATOMIC_RELEASE);
+			s = j;
 		}
 	}
+
+	__atomic_store_n(&ix->slot[s], 0, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+// Writer lock held. Adds one segment, starts a rehash into an index of
+// twice the size when the load factor would exceed 0.5. A rehash still
+// running takes a step first, the table grows once it is done.
+bool CAMTable::grow()
+{
+	if(nsegs == maxSegs)
+		return false;
+
+	size_t slots = SLOTS((nsegs + 1) * CAM_SEGMENT);
+
+	Index *ix = NULL;
+
+	if(slots > index->mask + 1)
+	{
+		if(old) migrate(CAM_MIGRATE);
+
+		if(old) return false; 					// previous rehash still running
+
+		if((ix = newIndex(slots)) == NULL)
+			return false;
+	}
+
+	Entry *seg = (Entry *)MAP(CAM_SEGMENT * sizeof(Entry));
+
+	if(seg == NULL)
+	{
+		if(ix) freeIndex(ix);
+		return false;
+	}
+
+	segs[nsegs] = seg;
+
+	for(size_t i = CAM_SEGMENT; i > 0; --i)
+	{
+		if(nsegs == 0 && i == 1) break; 	// entry 0 reserved
+
+		seg[i - 1].next = freeHead;
+		freeHead = nsegs * CAM_SEGMENT + i - 1;
+	}
+
+	capacity = ++nsegs * CAM_SEGMENT - 1;
+
+	if(ix)
+	{
+		migrated = 1;
+		migrateEnd = capacity + 1;
+
+		__atomic_store_n(&old, index, __ATOMIC_RELEASE);
+		__atomic_store_n(&index, ix, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+// Writer lock held. Copies live entries into the new index, the old one
+// is freed once no reader can be probing it.
+void CAMTable::migrate(size_t n)
+{
+	for(; n > 0 && migrated < migrateEnd; --n, ++migrated)
+	{
+		u_int64_t key = WORD_KEY(entry(migrated).word);
+		u_int64_t w;
+
+		if(entry(migrated).word && !lookup(index, key, &w))
+			place(index, key, migrated);
+	}
+
+	if(migrated < migrateEnd)
+		return;
+
+	Index *o = old;
+
+	__atomic_store_n(&old, (Index *)NULL, __ATOMIC_RELEASE);
+
+	Epoch::instance().retire(freeIndex, o);
+}
+
+// Writer lock held.
+void CAMTable::link(size_t i, time_t due)
+{
+	size_t s = due & (CAM_WHEEL_SIZE - 1);
+
+	Entry &e = entry(i);
+
+	e.next = wheel[s];
+	e.prev = 0x80000000 | s;
+
+	if(e.next)
+		entry(e.next).prev = i;
+
+	wheel[s] = i;
+}
+
+// Writer lock held.
+void CAMTable::unlink(size_t i)
+{
+	Entry &e = entry(i);
+
+	if(WHEEL_HEAD(e.prev))
+		wheel[e.prev & ~0x80000000] = e.next;
 	else
+		entry(e.prev).next = e.next;
+
+	if(e.next)
+		entry(e.next).prev = e.prev;
+}
+
+// Writer lock held. Entry must be unlinked.
+void CAMTable::remove(size_t i)
+{
+	Entry &e = entry(i);
+
+	u_int64_t key = WORD_KEY(e.word);
+
+	if(mirror) mirror->update(KEY_MAC(key), NULL);
+
+	unplace(index, key);
+
+	if(old) unplace(old, key);
+
+	PortState &ps = portState[WORD_PORT(e.word)];
+
+	__atomic_store_n(&ps.used, ps.used - 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&e.word, 0, __ATOMIC_RELEASE);
+
+	e.next = freeHead;
+	freeHead = i;
+
+	--used;
+
+	bump();
+}
+
+// Writer lock held. Passes the forwarding state of entry i on.
+void CAMTable::mirrored(size_t i)
+{
+	if(!mirror) return;
+
+	const Entry &e = entry(i);
+
+	mirror->update(KEY_MAC(WORD_KEY(e.word)),
+			e.state == QUARANTINED ? NULL : ports[WORD_PORT(e.word)]);
+}
+
+// Writer lock held. Refreshed entries move to their new expiry slot, the
+// list is detached first so that may be this very slot.
+void CAMTable::expire(size_t s, time_t now)
+{
+	u_int32_t i = wheel[s];
+
+	wheel[s] = 0;
+
+	while(i)
 	{
-		size_t &i = lookup[mac];
+		u_int32_t next = entry(i).next;
 
-		if(!i) 								// new address
+		time_t due = __atomic_load_n(&entry(i).stamp, __ATOMIC_RELAXED) + minTTL;
+
+		if(due <= now && mirror) 				// may still be forwarded by the mirror
 		{
-			i = free.front();
-			free.pop();
+			Entry &e = entry(i);
+
+			time_t idle = mirror->idle(KEY_MAC(WORD_KEY(e.word)));
 
-			table[i].port = p;
-			table[i].timeStamp = time(NULL);
+			if(idle < minTTL)
+			{
+				__atomic_store_n(&e.stamp, now - idle, __ATOMIC_RELAXED);
+				due = now - idle + minTTL;
+			}
+		}
+
+		if(due <= now)
+		{
+			remove(i);
 		}
 		else
 		{
-			table[i].port = p; 	// avoid port flapping
-			table[i].timeStamp = time(NULL);
+			Entry &e = entry(i);
+
+			if(e.state != STABLE && !ACTIVE(e.mark, now)) 	// before mark wraps
+			{
+				__atomic_store_n(&e.state, STABLE, __ATOMIC_RELAXED);
+				mirrored(i);
+				bump();
+			}
+
+			link(i, due);
+		}
+
+		i = next;
+	}
+}
+
+// Writer lock held. Slots are walked in expiry order, the first entry
+// whose real expiry is not later than its slot is the least recently
+// used one (to a second). Refreshed entries met on the way are moved to
+// their real slot, as expire() would do.
+size_t CAMTable::victimLRU()
+{
+	size_t best = 0;
+	time_t bestDue = 0;
+
+	for(time_t t = wheelTime + 1; t <= wheelTime + CAM_WHEEL_SIZE; ++t)
+	{
+		u_int32_t i = wheel[t & (CAM_WHEEL_SIZE - 1)];
+
+		while(i)
+		{
+			u_int32_t next = entry(i).next;
+
+			time_t due = entry(i).stamp + minTTL;
+
+			if(due <= t)
+				return i;
+
+			if(!best || due < bestDue)
+			{
+				best = i;
+				bestDue = due;
+			}
+
+			unlink(i);
+			link(i, due);
+
+			i = next;
+		}
+	}
+
+	return best; 											// TTL longer than the wheel
+}
+
+// Writer lock held. An entry touched since the hand started its sweep
+// gets a second chance, after CAM_CLOCK_SCAN of them the oldest goes.
+size_t CAMTable::victimCLOCK(time_t now)
+{
+	size_t best = 0;
+
+	for(size_t n = 0; n < CAM_CLOCK_SCAN; ++n)
+	{
+		if(++hand > capacity)
+		{
+			hand = 1;
+			handTime = now;
 		}
+
+		const Entry &e = entry(hand);
+
+		if(!e.word) continue;
+
+		if(e.stamp < handTime)
+			return hand;
+
+		if(!best || e.stamp < entry(best).stamp)
+			best = hand;
+	}
+
+	return best;
+}
+
+// Writer lock held. Forgets every address learned on port pn.
+void CAMTable::flush(u_int16_t pn)
+{
+	PortState &ps = portState[pn];
+
+	for(size_t i = 1; i <= capacity && ps.used; ++i)
+		if(entry(i).word && WORD_PORT(entry(i).word) == pn)
+		{
+			unlink(i);
+			remove(i);
+		}
+
+	__atomic_store_n(&ps.learns, 0, __ATOMIC_RELAXED);
+}
+
+// Writer lock held.
+bool CAMTable::evict(time_t now)
+{
+	size_t i = 0;
+
+	switch(policy)
+	{
+		case KEEP:
+			break;
+		case LRU:
+			i = victimLRU();
+			break;
+		case CLOCK:
+			i = victimCLOCK(now);
+			break;
+	}
+
+	if(!i) return false;
+
+	unlink(i);
+	remove(i);
+
+	++evicted;
+
+	return true;
+}
+
+// Init only, the table must be empty. Without a budget the capacity is
+// fixed, otherwise the table grows on demand while the budget allows.
+bool CAMTable::setCapacity(size_t entries, size_t bytes)
+{
+	release();
+
+	size_t want = (entries + CAM_SEGMENT) / CAM_SEGMENT; 	// entry 0 reserved
+
+	if(bytes && footprint(want) > bytes)
+		return false;
+
+	budget = bytes;
+	maxSegs = want;
+
+	if(budget)
+		while(footprint(maxSegs + 1) <= budget)
+			++maxSegs;
+
+	segs = new Entry *[maxSegs];
+
+	if((index = newIndex(SLOTS(want * CAM_SEGMENT))) == NULL)
+		return false;
+
+	for(size_t i = 0; i < want; ++i)
+		if(!grow())
+			return false;
+
+	return true;
+}
+
+void CAMTable::setMinTTL(unsigned sec)
+{
+	minTTL = sec;
+}
+
+void CAMTable::setDefaultPort(Port *p)
+{
+	defPort = p;
+}
+
+void CAMTable::setPolicy(Policy p)
+{
+	policy = p;
+}
+
+void CAMTable::setPortLimit(size_t entries, unsigned rate, Limit action)
+{
+	portMax = entries;
+	portRate = rate;
+	portLimit = action;
+}
+
+void CAMTable::setMirror(CAMMirror *m)
+{
+	pthread_mutex_lock(&lock);
+
+	mirror = m;
+
+	for(size_t i = 1; i <= capacity; ++i)
+		if(entry(i).word)
+			mirrored(i);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void CAMTable::setDamping(unsigned moves, unsigned window, unsigned hold,
+		bool quarantined)
+{
+	flapMoves = moves;
+	flapWindow = window;
+	flapHold = hold;
+	quarantine = quarantined;
+}
+
+void CAMTable::insert(const MACAddr &mac, Port *p)
+{
+	if(mac.isBroadcast()) return;
+
+	if(source(mac, p) != LEARN) return;
+
+	pthread_mutex_lock(&lock);
+
+	learn(mac.key(), p, CoarseClock::now());
+
+	pthread_mutex_unlock(&lock);
+}
+
+// Writer lock held. Counts a move to port pn, false if it is damped.
+bool CAMTable::move(size_t i, u_int16_t pn, time_t now)
+{
+	Entry &e = entry(i);
+
+	if(e.state != STABLE)
+	{
+		if(ACTIVE(e.mark, now))
+			return false;
+
+		__atomic_store_n(&e.state, STABLE, __ATOMIC_RELAXED);
+		e.moves = 0;
+
+		mirrored(i);
+		bump();
+	}
+
+	if(!flapMoves)
+		return true;
+
+	if(!e.moves || (u_int16_t)(now - e.mark) >= flapWindow)
+	{
+		e.moves = 0;
+		e.mark = now;
+	}
+
+	if(++e.moves < flapMoves)
+		return true;
+
+	FlapEvent ev;
+
+	ev.mac = KEY_MAC(WORD_KEY(e.word));
+	ev.from = ports[WORD_PORT(e.word)];
+	ev.to = ports[pn];
+	ev.time = now;
+	ev.action = quarantine ? QUARANTINED : PINNED;
+
+	if(flapLog.size() == CAM_FLAP_LOG)
+		flapLog.pop_front();
+
+	flapLog.push_back(ev);
+	++flaps;
+
+	e.moves = 0;
+	__atomic_store_n(&e.mark, (u_int16_t)(now + flapHold), __ATOMIC_RELAXED);
+	__atomic_store_n(&e.state, ev.action, __ATOMIC_RELEASE);
+
+	mirrored(i);
+	bump();
+
+	return false;
+}
+
+// Writer lock held.
+void CAMTable::learn(u_int64_t key, Port *p, time_t stamp)
+{
+	u_int16_t pn = portNumber(p);
+
+	if(!pn)
+	{
+		++refused;
+		return;
+	}
+
+	u_int64_t w;
+	size_t i;
+
+	if((i = lookup(key, &w)))
+	{
+		Entry &e = entry(i);
+
+		if(WORD_PORT(w) != pn)
+		{
+			if(!move(i, pn, stamp) || !admit(pn, stamp))
+				return;
+
+			PortState &from = portState[WORD_PORT(w)];
+			PortState &to = portState[pn];
+
+			__atomic_store_n(&from.used, from.used - 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&to.used, to.used + 1, __ATOMIC_RELAXED);
+
+			__atomic_store_n(&e.word, key << 16 | pn, __ATOMIC_RELEASE);
+
+			mirrored(i);
+			bump();
+		}
+
+		__atomic_store_n(&e.stamp, stamp, __ATOMIC_RELAXED);
+	}
+	else if(!admit(pn, stamp))
+		return;
+	else if(!freeHead && !grow() && !evict(stamp))
+		++refused;
+	else 															// new address
+	{
+		i = freeHead;
+
+		Entry &e = entry(i);
+
+		freeHead = e.next;
+
+		e.stamp = stamp;
+		e.moves = e.state = 0;
+		e.mark = 0;
+		__atomic_store_n(&e.word, key << 16 | pn, __ATOMIC_RELEASE);
+
+		place(index, key, i);
+		link(i, stamp + minTTL);
+
+		mirrored(i);
+
+		PortState &ps = portState[pn];
+
+		__atomic_store_n(&ps.used, ps.used + 1, __ATOMIC_RELAXED);
+
+		++used;
+
+		bump();
 	}
+}
 
-	pthread_rwlock_unlock(&lock);
+// Lock-free. A source to learn on port p, unless p is over its limit.
+CAMTable::Source CAMTable::unknown(const Port *p, time_t now) const
+{
+	if(portLimit != DROP_FRAME)
+		return LEARN;
+
+	u_int16_t pn = portNumber(p);
+
+	return pn && overLimit(pn, now) ? BLOCK : LEARN;
+}
+
+CAMTable::Source CAMTable::source(const MACAddr &mac, const Port *p)
+{
+	u_int64_t w;
+	size_t i = lookup(mac.key(), &w);
+
+	u_int32_t now = CoarseClock::now();
+
+	if(!i) return unknown(p, now);
+
+	Entry &e = entry(i);
+
+	u_int8_t state = __atomic_load_n(&e.state, __ATOMIC_ACQUIRE);
+	bool damped = state != STABLE
+		&& ACTIVE(__atomic_load_n(&e.mark, __ATOMIC_RELAXED), now);
+
+	if(damped && state == QUARANTINED)
+		return BLOCK;
+
+	if(__atomic_load_n(&ports[WORD_PORT(w)], __ATOMIC_ACQUIRE) != p)
+		return damped ? KNOWN : unknown(p, now); 	// pinned, ignore the move
+
+	if(e.stamp != now)
+		__atomic_store_n(&e.stamp, now, __ATOMIC_RELAXED);
+
+	return KNOWN;
+}
+
+// The home slots of the whole batch are prefetched before the first
+// learn, so their misses overlap.
+void CAMTable::learnBatch(const CAMLearn *l, size_t n)
+{
+	time_t now = CoarseClock::now();
+
+	pthread_mutex_lock(&lock);
+
+	for(size_t i = 0; i < n; ++i)
+		__builtin_prefetch(&index->slot[SLOT_HOME(l[i].mac.key(), index->mask)]);
+
+	for(size_t i = 0; i < n; ++i)
+		if(!l[i].mac.isBroadcast())
+			learn(l[i].mac.key(), l[i].port, now);
+
+	pthread_mutex_unlock(&lock);
 }
 
 Port * CAMTable::find(const MACAddr &mac)
@@ -110,64 +937,254 @@ Port * CAMTable::find(const MACAddr &mac)
 	if(mac.isBroadcast())
 		return &Broadcast::instance();
 
-	Port *p;
+	u_int64_t w;
+	size_t i = lookup(mac.key(), &w);
+
+	return resolve(i, w, CoarseClock::now());
+}
 
-	pthread_rwlock_rdlock(&lock);
+// Lookups in three passes over the batch: hash and prefetch the home
+// slots, probe for the tag and prefetch the entries, then validate. The
+// cache misses of the batch overlap instead of adding up.
+void CAMTable::findBatch(const MACAddr *mac, Port **port, size_t n)
+{
+	u_int64_t key[CAM_BATCH];
+	size_t cand[CAM_BATCH];
 
-	camlookup_t::const_iterator i = lookup.find(mac);
+	time_t now = CoarseClock::now();
 
-	if(i == lookup.end())
-		p = table[0].port;
-	else
+	for(size_t b = 0; b < n; b += CAM_BATCH)
 	{
-		p = table[i->second].port;
-		table[i->second].timeStamp = time(NULL);
+		size_t m = n - b < CAM_BATCH ? n - b : CAM_BATCH;
+
+		const Index *ix = __atomic_load_n(&index, __ATOMIC_ACQUIRE);
+
+		for(size_t i = 0; i < m; ++i)
+		{
+			key[i] = mac[b + i].key();
+			cand[i] = SLOT_HOME(key[i], ix->mask);
+
+			__builtin_prefetch(&ix->slot[cand[i]]);
+		}
+
+		for(size_t i = 0; i < m; ++i)
+		{
+			u_int64_t tag = SLOT_TAG(key[i]);
+			size_t s = cand[i];
+			u_int64_t v;
+
+			while((v = __atomic_load_n(&ix->slot[s], __ATOMIC_ACQUIRE))
+					&& (v & ~0xFFFFFFFFULL) != tag)
+				s = (s + 1) & ix->mask;
+
+			cand[i] = SLOT_ENTRY(v);
+
+			if(cand[i])
+				__builtin_prefetch(&entry(cand[i]));
+		}
+
+		for(size_t i = 0; i < m; ++i)
+		{
+			if(mac[b + i].isBroadcast())
+			{
+				port[b + i] = &Broadcast::instance();
+				continue;
+			}
+
+			u_int64_t w = 0;
+			size_t e = cand[i];
+
+			if(e)
+				w = __atomic_load_n(&entry(e).word, __ATOMIC_ACQUIRE);
+
+			if(!e || WORD_KEY(w) != key[i] || !WORD_PORT(w))
+				e = lookup(key[i], &w); 	// tag collision, rehash
+
+			port[b + i] = resolve(e, w, now);
+		}
 	}
+}
 
-	pthread_rwlock_unlock(&lock);
+// Lock-free. Egress for entry i, 0 if not found.
+Port * CAMTable::resolve(size_t i, u_int64_t w, time_t now)
+{
+	if(!i) return defPort;
 
-	return p;
+	Entry &e = entry(i);
+
+	if(__atomic_load_n(&e.state, __ATOMIC_ACQUIRE) == QUARANTINED
+			&& ACTIVE(__atomic_load_n(&e.mark, __ATOMIC_RELAXED), now))
+		return NULL;
+
+	if(e.stamp != now)
+		__atomic_store_n(&e.stamp, now, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&ports[WORD_PORT(w)], __ATOMIC_ACQUIRE);
 }
 
-void CAMTable::cleanup()
+void CAMTable::records(std::vector<CAMRecord> &r) const
 {
-	pthread_rwlock_wrlock(&lock);
+	pthread_mutex_lock(&lock);
+
+	time_t now = CoarseClock::now();
 
-	time_t now = time(NULL);
+	r.reserve(r.size() + used);
 
-	CAMTable::camlookup_t::iterator it = lookup.begin();
-	for(; it != lookup.end(); ++it)
+	for(size_t i = 1; i <= capacity; ++i)
 	{
-		if(now - table[it->second].timeStamp >= minTTL)
-		{
-			free.push(it->second);
-			lookup.erase(it);
-		}
+		const Entry &e = entry(i);
+
+		if(!e.word) continue;
+
+		CAMRecord rec;
+
+		rec.mac = KEY_MAC(WORD_KEY(e.word));
+		rec.port = ports[WORD_PORT(e.word)];
+		rec.age = now - e.stamp;
+
+		r.push_back(rec);
 	}
 
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
+}
+
+// Entries keep their remaining time to live.
+void CAMTable::restore(const CAMRecord *r, size_t n)
+{
+	time_t now = CoarseClock::now();
+
+	pthread_mutex_lock(&lock);
+
+	for(size_t i = 0; i < n; ++i)
+		if(r[i].age >= 0 && r[i].age < minTTL && !r[i].mac.isBroadcast())
+			learn(r[i].mac.key(), r[i].port, now - r[i].age);
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool CAMTable::rehash()
+{
+	pthread_mutex_lock(&lock);
+
+	if(old) migrate(CAM_MIGRATE);
+
+	bool pending = old != NULL;
+
+	pthread_mutex_unlock(&lock);
+
+	return pending;
+}
+
+// Visits only the slots that became due since the last call.
+void CAMTable::cleanup()
+{
+	pthread_mutex_lock(&lock);
+
+	time_t now = CoarseClock::now();
+
+	if(now - wheelTime > CAM_WHEEL_SIZE)
+		wheelTime = now - CAM_WHEEL_SIZE;
+
+	while(wheelTime < now)
+		expire(++wheelTime & (CAM_WHEEL_SIZE - 1), now);
+
+	pthread_mutex_unlock(&lock);
 }
 
 std::ostream & operator <<(std::ostream &os, const CAMTable &c)
 {
 	os << "MAC address\tPort\tAge";
 
-	pthread_rwlock_rdlock(&c.lock);
+	pthread_mutex_lock(&c.lock);
 
-	time_t now = time(NULL);
+	time_t now = CoarseClock::now();
 
-	CAMTable::camlookup_t::const_iterator it = c.lookup.begin();
+	for(size_t i = 1; i <= c.capacity; ++i)
+	{
+		const CAMTable::Entry &e = c.entry(i);
 
-	size_t i = 0;
+		if(!e.word) continue;
 
-	for(; it != c.lookup.end(); ++it, ++i)
-		os << std::endl << it->first << '\t' << c.table[it->second].port->name()
-			<< '\t' << (now - c.table[it->second].timeStamp);
+		os << std::endl << KEY_MAC(WORD_KEY(e.word)) << '\t'
+			<< c.ports[WORD_PORT(e.word)]->name() << '\t' << (now - e.stamp);
+	}
+
+	os << std::endl << "-- Total " << c.used << " / " << c.capacity << ", "
+		<< c.memory() / 1024;
 
-	os << std::endl << "-- Total " << i << " / " << CAM_TABLE_SIZE << " --";
+	if(c.budget)
+		os << " / " << c.budget / 1024;
 
-	pthread_rwlock_unlock(&c.lock);
+	os << " kB, evicted " << c.evicted << ", refused " << c.refused << " --";
+
+	pthread_mutex_unlock(&c.lock);
 
 	return os;
 }
 
+void CAMTable::showFlaps(std::ostream &os) const
+{
+	os << "MAC address\tFrom\tTo\tAction\t\tAge";
+
+	pthread_mutex_lock(&lock);
+
+	time_t now = CoarseClock::now();
+
+	std::deque<FlapEvent>::const_iterator it = flapLog.begin();
+
+	for(; it != flapLog.end(); ++it)
+		os << std::endl << it->mac << '\t' << it->from->name() << '\t'
+			<< it->to->name() << '\t'
+			<< (it->action == QUARANTINED ? "quarantined" : "pinned\t")
+			<< '\t' << (now - it->time);
+
+	os << std::endl << "-- Total " << flaps << " flaps, damping " << flapMoves
+		<< " moves / " << flapWindow << " s, hold " << flapHold << " s --";
+
+	pthread_mutex_unlock(&lock);
+}
+
+void CAMTable::showPorts(std::ostream &os) const
+{
+	os << "Port\t\tEntries\t\tRefused\t\tState";
+
+	pthread_mutex_lock(&lock);
+
+	for(size_t n = 1; n <= nports; ++n)
+		os << std::endl << ports[n]->name() << "\t\t" << portState[n].used
+			<< "\t\t" << portState[n].refused << "\t\t"
+			<< (ports[n]->isDown() ? "shutdown" : "up");
+
+	os << std::endl << "-- Limit ";
+
+	if(portMax)
+		os << portMax;
+	else
+		os << "none";
+
+	os << " entries, ";
+
+	if(portRate)
+		os << portRate;
+	else
+		os << "no";
+
+	os << " learns / s, on violation ";
+
+	switch(portLimit)
+	{
+		case DROP_LEARN:
+			os << "drop learn";
+			break;
+		case DROP_FRAME:
+			os << "drop frame";
+			break;
+		case SHUTDOWN:
+			os << "shutdown";
+			break;
+	}
+
+	os << " --";
+
+	pthread_mutex_unlock(&lock);
+}
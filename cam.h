@@ -34,6 +34,7 @@
 
 #include "mac.h"
 #include "port.h"
+#include "clock.h"
 
 #include <pthread.h>
 
@@ -41,55 +42,286 @@
 #include <cstdlib>
 
 #include <iostream>
-#include <map>
-#include <queue>
+#include <vector>
+#include <deque>
 
 
 #if CAM_TABLE_SIZE <= 0
-# 	define CAM_TABLE_SIZE 				512
+# 	define CAM_TABLE_SIZE 				512 	// initial entries
 #endif
 
 #if DEFAULT_MIN_TTL <= 0
 # 	define DEFAULT_MIN_TTL 				300
 #endif
 
+#if CAM_WHEEL_SIZE <= 0
+# 	define CAM_WHEEL_SIZE 				512 	// seconds, power of 2
+#endif
+
+#if CAM_CLOCK_SCAN <= 0
+# 	define CAM_CLOCK_SCAN 				32 		// entries per eviction
+#endif
+
+#if CAM_SEGMENT <= 0
+# 	define CAM_SEGMENT 						1024 	// entries, power of 2
+#endif
+
+#if CAM_MIGRATE <= 0
+# 	define CAM_MIGRATE 						4096 	// entries per rehash step
+#endif
+
+#if CAM_FLAP_LOG <= 0
+# 	define CAM_FLAP_LOG 					32 		// events kept for the CLI
+#endif
 
+#if DEFAULT_FLAP_MOVES <= 0
+# 	define DEFAULT_FLAP_MOVES 		5
+#endif
+
+#if DEFAULT_FLAP_WINDOW <= 0
+# 	define DEFAULT_FLAP_WINDOW 		10 		// seconds
+#endif
+
+#if DEFAULT_FLAP_HOLD <= 0
+# 	define DEFAULT_FLAP_HOLD 			60 		// seconds
+#endif
+
+#if CAM_BATCH <= 0
+# 	define CAM_BATCH 							32 		// lookups in flight
+#endif
+
+#if CAM_PORTS <= 0
+# 	define CAM_PORTS 							1024
+#endif
+
+#ifndef CACHE_LINE
+# 	define CACHE_LINE 								64
+#endif
+
+
+struct CAMLearn
+{
+	MACAddr mac;
+	Port *port;
+};
+
+struct CAMRecord
+{
+	MACAddr mac;
+	Port *port;
+	time_t age; 											// seconds
+};
+
+// Told of every change to the table with the writer lock held, so an
+// outside copy (an in-kernel forwarding table) can follow it. The port
+// is NULL once the address is gone or must not be forwarded. idle() is
+// asked before an entry ages out: seconds since the copy last saw the
+// address as a source, frames forwarded there never reach source().
+class CAMMirror
+{
+public:
+	virtual ~CAMMirror() {}
+
+	virtual void update(const MACAddr &mac, Port *p) = 0;
+	virtual unsigned idle(const MACAddr &mac) = 0;
+};
+
+// Lookups are lock-free: the MAC index is an open-addressing hash table
+// of 64-bit slots (tag << 32 | entry) read with atomic loads, an entry
+// holds the MAC and its port number in one word. Writers serialize on a
+// mutex and bump the generation after each change, so cached lookups
+// can be validated with one load.
+// Aging uses a timer wheel of one second slots: entries are linked at
+// their expiry second and refreshes only store the timestamp, cleanup()
+// reschedules the refreshed ones when their slot comes up.
+// An address moving between ports more than `moves' times within the
+// damping window is pinned to its last port (or quarantined) for the
+// hold time, so a loop cannot make the table thrash.
+// Every port may be limited in learned entries and learns per second,
+// so one port flooding random sources cannot take the whole table.
+// Entries live in fixed segments that are added on demand up to the
+// memory budget, the index then doubles and is rehashed incrementally
+// while lookups probe both. Readers must be inside an Epoch.
 class CAMTable
 {
+public:
+	enum Policy 											// full table replacement
+	{
+		KEEP, 													// refuse new addresses
+		LRU, 														// least recently used, via the wheel
+		CLOCK 													// second chance on timestamps
+	};
+	enum Source 											// verdict on a source address
+	{
+		LEARN, 													// unknown or moved, post it
+		KNOWN, 													// nothing to learn
+		BLOCK 													// quarantined, drop the frame
+	};
+	enum Limit 												// port over its learning limit
+	{
+		DROP_LEARN, 										// forward, but do not learn
+		DROP_FRAME, 										// drop frames from new addresses
+		SHUTDOWN 												// error-disable the port
+	};
 private:
-	typedef std::map<MACAddr, size_t> camlookup_t;
-	typedef std::queue<size_t> camfree_t;
+	enum Damp
+	{
+		STABLE,
+		PINNED,
+		QUARANTINED
+	};
 private:
 	struct Entry
 	{
-		Port *port;
-		time_t timeStamp;
+		u_int64_t word; 							// MAC << 16 | port number, 0 if free
+		u_int32_t stamp; 							// CoarseClock seconds
+		u_int32_t next, prev; 				// timer wheel or free list
+		u_int8_t moves; 							// within the damping window
+		u_int8_t state; 							// Damp
+		u_int16_t mark; 							// window start or hold end, 16 bits
+	};
+	struct PortState
+	{
+		size_t used; 										// learned entries
+		u_int32_t learns; 							// within second
+		u_int32_t second;
+		unsigned long refused;
+	};
+	struct FlapEvent
+	{
+		MACAddr mac;
+		Port *from, *to;
+		time_t time;
+		Damp action;
+	};
+	struct Index
+	{
+		u_int64_t *slot; 							// cache line aligned
+		size_t mask;
 	};
 private:
 	static CAMTable cam;
 private:
-	mutable pthread_rwlock_t lock;
+	mutable pthread_mutex_t lock; 	// writers only
+private:
+	Entry **segs;
+	size_t nsegs, maxSegs;
+	size_t capacity, used; 					// entry 0 reserved
+	size_t budget; 										// bytes, 0 fixed size
+	u_int32_t freeHead;
+private:
+	Index *index;
+	Index *old; 											// while rehashing
+	size_t migrated, migrateEnd;
+private:
+	Port *defPort;
+	Port *ports[CAM_PORTS]; 					// ports[0] unused
+	PortState portState[CAM_PORTS];
+	size_t nports;
+private:
+	size_t portMax; 									// entries, 0 unlimited
+	unsigned portRate; 								// learns per second, 0 unlimited
+	Limit portLimit;
+private:
+	u_int32_t wheel[CAM_WHEEL_SIZE];
+	time_t wheelTime; 								// last second expired
+private:
+	Policy policy;
+	size_t hand; 											// CLOCK
+	time_t handTime; 									// CLOCK, current sweep start
 private:
-	Entry table[CAM_TABLE_SIZE + 1]; 	// table[0] reserved
-	camlookup_t lookup;
-	camfree_t free;
+	unsigned flapMoves; 							// 0 disabled
+	unsigned flapWindow, flapHold; 		// seconds
+	bool quarantine;
+	std::deque<FlapEvent> flapLog;
+	unsigned long flaps;
+private:
+	unsigned long evicted, refused;
 private:
 	time_t minTTL; 									// seconds
+private:
+	CAMMirror *mirror;
+private:
+	u_int64_t gen __attribute__((aligned(CACHE_LINE))); 	// read per frame
+	char pad[CACHE_LINE - sizeof(u_int64_t)];
 private:
 	CAMTable();
+	~CAMTable();
+private:
+	static Index * newIndex(size_t slots);
+	static void freeIndex(void *ix);
+	void release();
+
+	void bump();
+
+	Entry & entry(size_t i) const;
+	static size_t footprint(size_t segs);
+	size_t memory() const;
+
+	u_int16_t portNumber(Port *p);
+	u_int16_t portNumber(const Port *p) const;
+	bool overLimit(u_int16_t pn, time_t now) const;
+	bool admit(u_int16_t pn, time_t now);
+	void flush(u_int16_t pn);
+	Source unknown(const Port *p, time_t now) const;
+
+	size_t lookup(const Index *ix, u_int64_t key, u_int64_t *word) const;
+	size_t lookup(u_int64_t key, u_int64_t *word) const;
+	Port * resolve(size_t i, u_int64_t word, time_t now);
+	void place(Index *ix, u_int64_t key, size_t i);
+	bool unplace(Index *ix, u_int64_t key);
+
+	bool grow();
+	void migrate(size_t n);
+
+	bool move(size_t i, u_int16_t pn, time_t now);
+	void learn(u_int64_t key, Port *p, time_t stamp);
+	void remove(size_t i);
+	void mirrored(size_t i);
+
+	void link(size_t i, time_t due);
+	void unlink(size_t i);
+	void expire(size_t s, time_t now);
+
+	size_t victimLRU();
+	size_t victimCLOCK(time_t now);
+	bool evict(time_t now);
 public: 	// static //
 	static CAMTable & instance();
 public: 	// init //
+	bool setCapacity(size_t entries, size_t bytes);
 	void setMinTTL(unsigned sec);
 	void setDefaultPort(Port *p);
+	void setPolicy(Policy p);
+	void setDamping(unsigned moves, unsigned window, unsigned hold,
+			bool quarantined);
+	void setPortLimit(size_t entries, unsigned rate, Limit action);
+	void setMirror(CAMMirror *m); 		// replays the current entries
 public: 	// non-concurrent //
 	friend std::ostream & operator <<(std::ostream &os, const CAMTable &c);
+	void showFlaps(std::ostream &os) const;
+	void showPorts(std::ostream &os) const;
 public: 	// concurrent //
 	void insert(const MACAddr &mac, Port *p);
-	Port * find(const MACAddr &mac);
+	Port * find(const MACAddr &mac); 	// NULL if quarantined
+	void findBatch(const MACAddr *mac, Port **port, size_t n);
+
+	Source source(const MACAddr &mac, const Port *p); 	// never locks
+	u_int64_t generation() const; 		// changes on every learn/move/age
+	void learnBatch(const CAMLearn *l, size_t n);
 
+	void records(std::vector<CAMRecord> &r) const;
+	void restore(const CAMRecord *r, size_t n);
+
+	bool rehash(); 										// step, true while pending
 	void cleanup(); 									// periodically called
 };
 
 
+inline u_int64_t CAMTable::generation() const
+{
+	return __atomic_load_n(&gen, __ATOMIC_ACQUIRE);
+}
+
+
 #endif /* _CAM_H_ */
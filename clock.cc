@@ -0,0 +1,90 @@
+//===================================================================
+// File:        clock.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Coarse clock
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "clock.h"
+
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <string>
+
+
+time_t CoarseClock::sec = time(NULL);
+
+
+void CoarseClock::tick()
+{
+	__atomic_store_n(&sec, time(NULL), __ATOMIC_RELAXED);
+}
+
+
+Timer::Timer(unsigned period)
+{
+	if((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		throw std::string("timerfd_create(): ") + strerror(errno);
+
+	itimerspec it;
+
+	memset(&it, 0, sizeof(it));
+
+	it.it_value.tv_sec = it.it_interval.tv_sec = period ? period : 1;
+
+	if(timerfd_settime(fd, 0, &it, NULL) == -1)
+	{
+		std::string e = std::string("timerfd_settime(): ") + strerror(errno);
+
+		close(fd);
+
+		throw e;
+	}
+}
+
+Timer::~Timer()
+{
+	close(fd);
+}
+
+int Timer::descriptor() const
+{
+	return fd;
+}
+
+unsigned long Timer::expired()
+{
+	u_int64_t n;
+
+	if(read(fd, &n, sizeof(n)) != sizeof(n))
+		return 0;
+
+	return n;
+}
@@ -0,0 +1,73 @@
+//===================================================================
+// File:        clock.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Coarse clock
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+
+#include <ctime>
+
+
+// Seconds, advanced by the cleaner thread. Reading it on the forwarding
+// path costs one load instead of a time(2) call.
+class CoarseClock
+{
+private:
+	static time_t sec;
+public:
+	static time_t now();
+	static void tick(); 							// once a second
+};
+
+// Expires every period seconds on a timerfd, so periodic jobs wait in
+// poll() next to other descriptors and do not drift. Throws on setup.
+class Timer
+{
+private:
+	int fd;
+private:
+	Timer(const Timer &);
+	Timer & operator =(const Timer &);
+public:
+	Timer(unsigned period);
+	~Timer();
+
+	int descriptor() const;
+	unsigned long expired(); 					// since the last call, 0 if none
+};
+
+
+inline time_t CoarseClock::now()
+{
+	return __atomic_load_n(&sec, __ATOMIC_RELAXED);
+}
+
+
+#endif /* _CLOCK_H_ */
@@ -0,0 +1,311 @@
+//===================================================================
+// File:        driver.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Port backends
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "driver.h"
+#include "packet.h"
+#include "xdp.h"
+#include "uring.h"
+
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <sstream>
+
+
+#ifndef PACKET_FANOUT_FLAG_UNIQUEID
+# define PACKET_FANOUT_FLAG_UNIQUEID 0x2000
+#endif
+
+
+DriverConfig::DriverConfig()
+:
+	type("pcap")
+{
+}
+
+size_t DriverConfig::get(const char *key, size_t def) const
+{
+	std::map<std::string, size_t>::const_iterator it = opt.find(key);
+
+	return it == opt.end() ? def : it->second;
+}
+
+void DriverConfig::check(const char *keys) const
+{
+	std::map<std::string, size_t>::const_iterator it = opt.begin();
+
+	for(; it != opt.end(); ++it)
+	{
+		std::istringstream ss(keys);
+		std::string k;
+
+		while(ss >> k && k != it->first)
+			;
+
+		if(k != it->first)
+			throw std::string("unknown ") + type + " option `" + it->first + "'";
+	}
+}
+
+
+Driver * Driver::create(const char *ifname, const DriverConfig &c)
+{
+	if(c.type == "pcap")
+		return new PcapDriver(ifname, c);
+	if(c.type == "packet")
+		return new PacketDriver(ifname, c);
+	if(c.type == "xdp")
+		return new XdpDriver(ifname, c);
+	if(c.type == "uring")
+		return new UringDriver(ifname, c);
+
+	throw std::string("unknown driver `") + c.type + "'";
+}
+
+Driver::~Driver()
+{
+}
+
+void Driver::send(const Frame *f, size_t n)
+{
+	for(size_t i = 0; i < n; ++i)
+		send(f[i].data, f[i].len);
+}
+
+// The kernel copies straight from the frames. What the socket does not
+// take is dropped.
+void Driver::transmit(int fd, const Frame *f, size_t n)
+{
+	enum { MMSG = 64 };
+
+	mmsghdr msg[MMSG];
+	iovec iov[MMSG];
+
+	while(n)
+	{
+		unsigned m = n < (size_t)MMSG ? n : (size_t)MMSG;
+
+		memset(msg, 0, m * sizeof(mmsghdr));
+
+		for(unsigned i = 0; i < m; ++i)
+		{
+			iov[i].iov_base = (void *)f[i].data;
+			iov[i].iov_len = f[i].len;
+
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int s = sendmmsg(fd, msg, m, 0);
+
+		if(s <= 0) return;
+
+		f += s;
+		n -= s;
+	}
+}
+
+// Hash mode keeps a flow on one socket of the group. A new group takes
+// an id the kernel picks, it is read back for the others to join.
+int Driver::join(int fd, int group)
+{
+	int arg = group < 0 ? PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_UNIQUEID
+		: PACKET_FANOUT_HASH;
+
+	arg = arg << 16 | (group < 0 ? 0 : group);
+
+	if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1)
+		throw std::string("setsockopt(PACKET_FANOUT): ") + strerror(errno);
+
+	if(group >= 0)
+		return group;
+
+	socklen_t len = sizeof(arg);
+
+	if(getsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, &len) == -1)
+		throw std::string("getsockopt(PACKET_FANOUT): ") + strerror(errno);
+
+	return arg & 0xffff;
+}
+
+bool Driver::busyPoll(unsigned usec)
+{
+	(void)usec;
+
+	return false;
+}
+
+int Driver::fanout(int group)
+{
+	(void)group;
+
+	throw std::string(type()) + " has a single receiver";
+}
+
+
+// Frames are only valid inside the callback, the capture ring slot is
+// handed back to the kernel when it returns. They are packed one after
+// another, the burst ends early once a frame of SNAPLEN might not fit.
+// Frames cut short by the snap length are dropped rather than forwarded.
+void PcapDriver::collect(u_char *user, const pcap_pkthdr *h, const u_char *data)
+{
+	PcapDriver *d = (PcapDriver *)user;
+
+	if(h->caplen != h->len || h->caplen > SNAPLEN || d->used > d->cap * FRAME)
+		return; 													// cut short, or after a break
+
+	u_int8_t *f = d->arena + d->used;
+
+	memcpy(f, data, h->caplen);
+
+	d->out[d->nout].data = f;
+	d->out[d->nout].len = h->caplen;
+	d->out[d->nout].ref = NULL;
+
+	++d->nout;
+
+	d->used += (h->caplen + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+	if(d->used > d->cap * FRAME)
+		pcap_breakloop(d->fp);
+}
+
+PcapDriver::PcapDriver(const char *ifname, const DriverConfig &c)
+:
+	txfd(-1), arena(NULL), cap(0), used(0), out(NULL), nout(0)
+{
+	char perr[PCAP_ERRBUF_SIZE];
+
+	c.check("");
+
+	if((fp = pcap_create(ifname, perr)) == NULL)
+		throw std::string("pcap_create(): ") + perr;
+
+	// Immediate mode hands over frames as they come, a burst is whatever
+	// queued up since the last receive.
+
+	if(pcap_set_snaplen(fp, SNAPLEN) || pcap_set_promisc(fp, 1)
+			|| pcap_set_immediate_mode(fp, 1) || pcap_activate(fp) < 0)
+	{
+		std::string e = pcap_geterr(fp);
+
+		pcap_close(fp);
+
+		throw std::string("pcap_activate(): ") + e;
+	}
+
+	//if(pcap_setdirection(fp, PCAP_D_IN) == -1)
+		//throw std::string("pcap_set_direction(): ") + pcap_geterr(fp);
+
+	sockaddr_ll ll;
+
+	memset(&ll, 0, sizeof(ll));
+
+	ll.sll_family = AF_PACKET;
+	ll.sll_ifindex = if_nametoindex(ifname);
+
+	if((txfd = socket(AF_PACKET, SOCK_RAW, 0)) == -1
+			|| bind(txfd, (sockaddr *)&ll, sizeof(ll)) == -1)
+	{
+		std::string e = std::string("socket(): ") + strerror(errno);
+
+		if(txfd != -1) close(txfd);
+
+		pcap_close(fp);
+
+		throw e;
+	}
+}
+
+PcapDriver::~PcapDriver()
+{
+	pcap_close(fp);
+	close(txfd);
+
+	delete [] arena;
+}
+
+size_t PcapDriver::recv(Frame *f, size_t n)
+{
+	if(n > cap)
+	{
+		delete [] arena;
+
+		arena = new u_int8_t[n * FRAME + SNAPLEN];
+		cap = n;
+	}
+
+	out = f;
+	nout = 0;
+	used = 0;
+
+	pcap_dispatch(fp, n, collect, (u_char *)this); 	// -2 after a break
+
+	return nout;
+}
+
+void PcapDriver::send(const u_int8_t *frame, size_t len)
+{
+	pcap_sendpacket(fp, frame, len); 	// auto synchronized
+}
+
+void PcapDriver::send(const Frame *f, size_t n)
+{
+	transmit(txfd, f, n);
+}
+
+int PcapDriver::fanout(int group)
+{
+	return join(pcap_fileno(fp), group);
+}
+
+int PcapDriver::nonblock()
+{
+	char perr[PCAP_ERRBUF_SIZE];
+
+	if(pcap_setnonblock(fp, 1, perr) == -1)
+		throw std::string("pcap_setnonblock(): ") + perr;
+
+	int fd = pcap_get_selectable_fd(fp);
+
+	if(fd == -1)
+		throw std::string("pcap_get_selectable_fd(): no descriptor");
+
+	return fd;
+}
+
+const char * PcapDriver::type() const
+{
+	return "pcap";
+}
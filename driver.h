@@ -0,0 +1,146 @@
+//===================================================================
+// File:        driver.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Port backends
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _DRIVER_H_
+#define _DRIVER_H_
+
+
+#include "pool.h"
+
+#include <sys/types.h>
+
+#include <pcap.h>
+#include <libnet.h>
+
+#include <map>
+#include <string>
+
+
+// A frame from a ring-backed driver holds its block through ref, other
+// frames are only valid until the next recv() on their port. A pooled
+// frame goes back to the FramePool with its last drop().
+struct Frame
+{
+	const u_int8_t *data;
+	size_t len;
+	unsigned *ref; 										// NULL if not counted
+
+	void hold() const;
+	void drop() const;
+};
+
+// Backend selection and its tunables, numeric values with k/M/G suffix.
+struct DriverConfig
+{
+	std::string type;
+	std::map<std::string, size_t> opt;
+
+	DriverConfig();
+
+	size_t get(const char *key, size_t def) const;
+	void check(const char *keys) const; 	// throws unknown key
+};
+
+// Moves frames between an interface and the switch. recv() is called by
+// the receiving thread only, send() by any thread.
+class Driver
+{
+protected:
+	static void transmit(int fd, const Frame *f, size_t n); 	// sendmmsg
+	static int join(int fd, int group); 	// PACKET_FANOUT, throws
+public:
+	static Driver * create(const char *ifname, const DriverConfig &c);
+public:
+	virtual ~Driver();
+
+	virtual size_t recv(Frame *f, size_t n) = 0; 	// valid until next call
+	virtual void send(const u_int8_t *frame, size_t len) = 0;
+	virtual void send(const Frame *f, size_t n);
+
+	// Spreads the port's receive over several drivers by flow hash, group
+	// < 0 starts a new one. Returns the group, throws if not supported.
+	virtual int fanout(int group);
+
+	// From then on recv() returns 0 instead of waiting for frames. The
+	// returned descriptor polls readable while frames are there.
+	virtual int nonblock() = 0; 				// throws
+
+	// Has an empty nonblocking recv() poll the device queue for up to usec
+	// itself. False if the socket cannot, throws on failure.
+	virtual bool busyPoll(unsigned usec);
+
+	virtual const char *type() const = 0;
+};
+
+// Batches go out with sendmmsg() on a raw socket, libpcap has no batch
+// send.
+class PcapDriver : public Driver
+{
+	enum { SNAPLEN = IP_MAXPACKET + LIBNET_ETH_H, FRAME = 2048, ALIGN = 64 };
+private:
+	pcap_t *fp;
+	int txfd;
+private:
+	u_int8_t *arena; 									// cap * FRAME + SNAPLEN, packed
+	size_t cap;
+	size_t used;
+	Frame *out;
+	size_t nout;
+private:
+	static void collect(u_char *user, const pcap_pkthdr *h, const u_char *data);
+public:
+	PcapDriver(const char *ifname, const DriverConfig &c);
+	~PcapDriver();
+
+	size_t recv(Frame *f, size_t n);
+	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame *f, size_t n);
+
+	int fanout(int group);
+	int nonblock();
+
+	const char *type() const;
+};
+
+
+inline void Frame::hold() const
+{
+	if(ref) __atomic_add_fetch(ref, 1, __ATOMIC_RELAXED);
+}
+
+inline void Frame::drop() const
+{
+	if(ref && !__atomic_sub_fetch(ref, 1, __ATOMIC_ACQ_REL)
+			&& FramePool::instance().owns(ref))
+		FramePool::instance().put(ref);
+}
+
+
+#endif /* _DRIVER_H_ */
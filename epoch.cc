@@ -0,0 +1,118 @@
+//===================================================================
+// File:        epoch.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Epoch based memory reclamation
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "epoch.h"
+
+
+Epoch Epoch::ep;
+
+
+Epoch::Epoch()
+:
+	global(1)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+Epoch & Epoch::instance()
+{
+	return ep;
+}
+
+Epoch::~Epoch()
+{
+	for(size_t i = 0; i < retired.size(); ++i)
+		retired[i].release(retired[i].ptr);
+
+	for(size_t i = 0; i < records.size(); ++i)
+		delete records[i];
+}
+
+EpochRecord * Epoch::attach()
+{
+	EpochRecord *r = new EpochRecord;
+
+	r->epoch = 0;
+
+	pthread_mutex_lock(&lock);
+
+	records.push_back(r);
+
+	pthread_mutex_unlock(&lock);
+
+	return r;
+}
+
+void Epoch::retire(void (*release)(void *), void *ptr)
+{
+	pthread_mutex_lock(&lock);
+
+	Retired r;
+
+	r.epoch = global;
+	r.release = release;
+	r.ptr = ptr;
+
+	retired.push_back(r);
+
+	__atomic_store_n(&global, global + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&lock);
+}
+
+// A reader inside epoch E may hold anything retired in epoch >= E.
+void Epoch::reclaim()
+{
+	pthread_mutex_lock(&lock);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	unsigned long oldest = global;
+
+	for(size_t i = 0; i < records.size(); ++i)
+	{
+		unsigned long e = __atomic_load_n(&records[i]->epoch, __ATOMIC_ACQUIRE);
+
+		if(e && e < oldest)
+			oldest = e;
+	}
+
+	size_t n = 0;
+
+	for(size_t i = 0; i < retired.size(); ++i)
+		if(retired[i].epoch < oldest)
+			retired[i].release(retired[i].ptr);
+		else
+			retired[n++] = retired[i];
+
+	retired.resize(n);
+
+	pthread_mutex_unlock(&lock);
+}
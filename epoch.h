@@ -0,0 +1,98 @@
+//===================================================================
+// File:        epoch.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Epoch based memory reclamation
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+
+#include <pthread.h>
+
+#include <vector>
+
+
+#ifndef CACHE_LINE
+# 	define CACHE_LINE 								64
+#endif
+
+
+struct EpochRecord
+{
+	unsigned long epoch; 							// 0 when outside
+} __attribute__((aligned(CACHE_LINE)));
+
+// Readers of lock-free structures bracket each access with enter() and
+// leave(), writers retire() unlinked memory and reclaim() frees it once
+// no reader that could have seen it is still inside.
+class Epoch
+{
+private:
+	struct Retired
+	{
+		unsigned long epoch;
+		void (*release)(void *);
+		void *ptr;
+	};
+private:
+	static Epoch ep;
+private:
+	pthread_mutex_t lock;
+	unsigned long global;
+	std::vector<EpochRecord *> records;
+	std::vector<Retired> retired;
+private:
+	Epoch();
+public: 	// static //
+	static Epoch & instance();
+	static void enter(EpochRecord *r);
+	static void leave(EpochRecord *r);
+public:
+	~Epoch();
+public: 	// concurrent //
+	EpochRecord * attach(); 					// once per reader thread
+
+	void retire(void (*release)(void *), void *ptr);
+	void reclaim(); 									// periodically called
+};
+
+
+inline void Epoch::enter(EpochRecord *r)
+{
+	__atomic_store_n(&r->epoch, __atomic_load_n(&ep.global, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+inline void Epoch::leave(EpochRecord *r)
+{
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+#endif /* _EPOCH_H_ */
@@ -0,0 +1,399 @@
+//===================================================================
+// File:        fastpath.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    In-kernel XDP forwarding of known unicast
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "fastpath.h"
+#include "xdp.h"
+
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+
+
+FastPath FastPath::fp;
+
+
+inline static int BPF(int cmd, bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+inline static bpf_insn INSN(u_int8_t code, u_int8_t dst, u_int8_t src,
+		int16_t off, int32_t imm)
+{
+	bpf_insn i;
+
+	memset(&i, 0, sizeof(i));
+
+	i.code = code;
+	i.dst_reg = dst;
+	i.src_reg = src;
+	i.off = off;
+	i.imm = imm;
+
+	return i;
+}
+
+inline static void LD_MAP(std::vector<bpf_insn> &p, u_int8_t dst, int fd)
+{
+	p.push_back(INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd));
+	p.push_back(INSN(0, 0, 0, 0, 0));
+}
+
+inline static void KEY(u_int8_t *k, const MACAddr &mac) 	// as the program
+{
+	memset(k, 0, sizeof(u_int64_t));
+	memcpy(k, (const u_int8_t *)mac, MACAddr::LENGTH);
+}
+
+inline static u_int32_t SEEN() 										// as the program
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) >> 30;
+}
+
+
+FastPath::FastPath()
+:
+	fdb(-1), devmap(-1), size(0), mirrored(0), failed(0), err("")
+{
+}
+
+FastPath::~FastPath()
+{
+	if(fdb != -1) close(fdb);
+	if(devmap != -1) close(devmap);
+}
+
+FastPath & FastPath::instance()
+{
+	return fp;
+}
+
+bool FastPath::fail(const char *what)
+{
+	err = std::string("FastPath(): ") + what + "(): " + strerror(errno);
+
+	return false;
+}
+
+const std::string & FastPath::error() const
+{
+	return err;
+}
+
+// Per port, with its interface index `me' and the XSKMAP of its socket:
+//
+// 	if data + 14 > data_end 			goto slow
+// 	if dst & multicast 						goto slow
+// 	v = fdb[src] 									learned here?
+// 	if !v || v->port != me 				goto slow
+// 	v->seen = ktime_get_ns() >> 30
+// 	if !devmap[me] 								goto slow 	port down
+// 	v = fdb[dst]
+// 	if !v 												goto slow
+// 	if v->port == me 							return XDP_DROP
+// 	return bpf_redirect_map(devmap, v->port, XDP_DROP)
+// slow:
+// 	return bpf_redirect_map(xskmap, ctx->rx_queue_index, XDP_PASS)
+//
+// The keys are built on the stack, src at fp - 8 and dst at fp - 16.
+void FastPath::load(Interface *i)
+{
+	XdpDriver *x = dynamic_cast<XdpDriver *>(i->backend());
+	int32_t me = i->index();
+
+	std::vector<bpf_insn> p;
+	std::vector<size_t> slow; 				// jumps to patch
+
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+				offsetof(xdp_md, data), 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6,
+				offsetof(xdp_md, data_end), 0));
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+	p.push_back(INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14));
+	slow.push_back(p.size());
+	p.push_back(INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));
+
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, 0, 0));
+	p.push_back(INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, 1));
+	slow.push_back(p.size());
+	p.push_back(INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0, 0));
+
+	p.push_back(INSN(BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0, -8, 0));
+	p.push_back(INSN(BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0, -16, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_2, 6, 0));
+	p.push_back(INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -8, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 10, 0));
+	p.push_back(INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -4, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_2, 0, 0));
+	p.push_back(INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -16, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2, 4, 0));
+	p.push_back(INSN(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -12, 0));
+
+	LD_MAP(p, BPF_REG_1, fdb);
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+	p.push_back(INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8));
+	p.push_back(INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+	slow.push_back(p.size());
+	p.push_back(INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_0,
+				offsetof(Value, port), 0));
+	slow.push_back(p.size());
+	p.push_back(INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0, me));
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0));
+	p.push_back(INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns));
+	p.push_back(INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_0, 0, 0, 30));
+	p.push_back(INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_0,
+				offsetof(Value, seen), 0));
+
+	p.push_back(INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -20, me));
+	LD_MAP(p, BPF_REG_1, devmap);
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+	p.push_back(INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -20));
+	p.push_back(INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+	slow.push_back(p.size());
+	p.push_back(INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0));
+
+	LD_MAP(p, BPF_REG_1, fdb);
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+	p.push_back(INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -16));
+	p.push_back(INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+	slow.push_back(p.size());
+	p.push_back(INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0));
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_0,
+				offsetof(Value, port), 0));
+	p.push_back(INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 5, me)); 	// drop
+	LD_MAP(p, BPF_REG_1, devmap);
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_DROP));
+	p.push_back(INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+	p.push_back(INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP));
+	p.push_back(INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	for(size_t j = 0; j < slow.size(); ++j)
+		p[slow[j]].off = p.size() - slow[j] - 1;
+
+	p.push_back(INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+				offsetof(xdp_md, rx_queue_index), 0));
+	LD_MAP(p, BPF_REG_1, x->socketMap());
+	p.push_back(INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+	p.push_back(INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+	p.push_back(INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	x->load(&p[0], p.size());
+}
+
+// Writer side of the devmap only, the program reads it.
+void FastPath::setUp(size_t i, bool u)
+{
+	u_int32_t key = i;
+	u_int32_t val = dynamic_cast<XdpDriver *>(ports[i]->backend())->ifindex();
+
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_fd = devmap;
+	a.key = (u_int64_t)&key;
+	a.value = (u_int64_t)&val;
+
+	if(BPF(u ? BPF_MAP_UPDATE_ELEM : BPF_MAP_DELETE_ELEM, &a) == -1
+			&& errno != ENOENT)
+		std::cerr << "ERROR: FastPath(): devmap " << ports[i]->name() << ": "
+			<< strerror(errno) << std::endl;
+
+	up[i] = u;
+}
+
+// Call once the interfaces are open, before traffic. Replaces the program
+// of every xdp port and mirrors the CAM table from then on.
+bool FastPath::enable(const InterfaceStack &ifs, size_t entries)
+{
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_type = BPF_MAP_TYPE_HASH;
+	a.key_size = sizeof(u_int64_t);
+	a.value_size = sizeof(Value);
+	a.max_entries = size = entries;
+
+	if((fdb = BPF(BPF_MAP_CREATE, &a)) == -1)
+		return fail("bpf(BPF_MAP_CREATE)");
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_type = BPF_MAP_TYPE_DEVMAP;
+	a.key_size = sizeof(u_int32_t);
+	a.value_size = sizeof(u_int32_t);
+	a.max_entries = ifs.size();
+
+	if((devmap = BPF(BPF_MAP_CREATE, &a)) == -1)
+		return fail("bpf(BPF_MAP_CREATE)");
+
+	ports.assign(ifs.size(), NULL);
+	up.assign(ifs.size(), false);
+
+	size_t n = 0;
+
+	for(size_t i = 0; i < ifs.size(); ++i)
+		if(dynamic_cast<XdpDriver *>(ifs[i]->backend()))
+		{
+			ports[i] = ifs[i];
+			setUp(i, !ifs[i]->isDown());
+
+			++n;
+		}
+
+	if(n < 2)
+	{
+		err = "FastPath(): needs two xdp ports at least";
+
+		return false;
+	}
+
+	for(size_t i = 0; i < ports.size(); ++i)
+		if(ports[i])
+			try
+			{
+				load(ports[i]);
+			}
+			catch(const std::string &e)
+			{
+				err = std::string("FastPath(): ") + ports[i]->name() + ": " + e;
+
+				return false;
+			}
+
+	CAMTable::instance().setMirror(this);
+
+	return true;
+}
+
+// Addresses on other ports are deleted, a move away from the fast ports
+// must not leave a stale entry behind.
+void FastPath::update(const MACAddr &mac, Port *p)
+{
+	Interface *i = dynamic_cast<Interface *>(p);
+
+	u_int8_t key[sizeof(u_int64_t)];
+
+	KEY(key, mac);
+
+	Value val;
+
+	memset(&val, 0, sizeof(val));
+
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_fd = fdb;
+	a.key = (u_int64_t)key;
+
+	if(i && i->index() < ports.size() && ports[i->index()])
+	{
+		val.port = i->index();
+
+		a.value = (u_int64_t)&val;
+		a.flags = BPF_NOEXIST;
+
+		if(BPF(BPF_MAP_UPDATE_ELEM, &a) == 0)
+			++mirrored;
+		else if(errno != EEXIST)
+			++failed; 											// full, stays on the slow path
+		else
+		{
+			a.flags = BPF_EXIST;
+
+			if(BPF(BPF_MAP_UPDATE_ELEM, &a) == -1)
+				++failed;
+		}
+	}
+	else if(BPF(BPF_MAP_DELETE_ELEM, &a) == 0)
+		--mirrored;
+}
+
+unsigned FastPath::idle(const MACAddr &mac)
+{
+	u_int8_t key[sizeof(u_int64_t)];
+
+	KEY(key, mac);
+
+	Value val;
+
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_fd = fdb;
+	a.key = (u_int64_t)key;
+	a.value = (u_int64_t)&val;
+
+	if(BPF(BPF_MAP_LOOKUP_ELEM, &a) == -1 || !val.seen)
+		return ~0U;
+
+	return ((u_int64_t)(SEEN() - val.seen) << 30) / 1000000000;
+}
+
+// Cleaner thread. Ports shut down by the CAM table (or re-enabled) leave
+// or rejoin the devmap within a second.
+void FastPath::sync()
+{
+	for(size_t i = 0; i < ports.size(); ++i)
+		if(ports[i] && ports[i]->isDown() == up[i])
+			setUp(i, !up[i]);
+}
+
+std::ostream & operator <<(std::ostream &os, const FastPath &f)
+{
+	os << "Port\t\tIfindex\t\tState";
+
+	for(size_t i = 0; i < f.ports.size(); ++i)
+		if(f.ports[i])
+			os << std::endl << f.ports[i]->name() << "\t\t"
+				<< dynamic_cast<XdpDriver *>(f.ports[i]->backend())->ifindex() << "\t\t"
+				<< (f.up[i] ? "forwarding" : "down");
+
+	os << std::endl << "-- Mirrored " << f.mirrored << " / " << f.size
+		<< " entries, failed " << f.failed << " --";
+
+	return os;
+}
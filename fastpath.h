@@ -0,0 +1,95 @@
+//===================================================================
+// File:        fastpath.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    In-kernel XDP forwarding of known unicast
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _FASTPATH_H_
+#define _FASTPATH_H_
+
+
+#include "cam.h"
+#include "port.h"
+
+#include <sys/types.h>
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+
+#if FAST_FDB_SIZE <= 0
+# 	define FAST_FDB_SIZE 					65536 	// kernel table entries
+#endif
+
+
+// Known unicast between AF_XDP ports is forwarded by the XDP program of
+// the ingress port: a BPF hash map mirrors the CAM table (MAC to
+// interface index) and a devmap holds the ports that are up. Multicast,
+// unknown destinations, sources not known on the ingress port and
+// destinations behind other backends go to the port's socket and
+// traffic() as before, so the CAM table stays the one that learns.
+class FastPath : public CAMMirror
+{
+private:
+	struct Value
+	{
+		u_int32_t port; 								// interface index
+		u_int32_t seen; 								// CLOCK_MONOTONIC ns >> 30, 0 never
+	};
+private:
+	static FastPath fp;
+private:
+	int fdb, devmap;
+	size_t size, mirrored;
+	unsigned long failed;
+	std::vector<Interface *> ports; 	// by interface index, NULL if slow
+	std::vector<bool> up;
+	std::string err;
+private:
+	FastPath();
+private:
+	bool fail(const char *what);
+	void load(Interface *i); 					// throws
+	void setUp(size_t i, bool u);
+public:
+	static FastPath & instance();
+public:
+	~FastPath();
+public: 	// init //
+	bool enable(const InterfaceStack &ifs, size_t entries);
+	const std::string & error() const;
+public: 	// concurrent //
+	void update(const MACAddr &mac, Port *p); 	// CAM writer lock held
+	unsigned idle(const MACAddr &mac); 					// CAM writer lock held
+	void sync(); 											// periodically, follows port state
+
+	friend std::ostream & operator <<(std::ostream &os, const FastPath &f);
+};
+
+
+#endif /* _FASTPATH_H_ */
@@ -0,0 +1,78 @@
+//===================================================================
+// File:        flow.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Per-thread exact-match flow cache
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "flow.h"
+
+#include <cstring>
+
+
+FlowCache::FlowCache()
+{
+	memset(table, 0, sizeof(table));
+}
+
+size_t FlowCache::hash(const Port *in, u_int64_t src, u_int64_t dst)
+{
+	u_int64_t h = (src * 0x9E3779B97F4A7C15ULL) ^ (dst * 0xC2B2AE3D27D4EB4FULL)
+		^ (u_int64_t)(size_t)in;
+
+	return (h ^ (h >> 29)) & (FLOW_CACHE_SIZE - 1);
+}
+
+Port * FlowCache::find(const Port *in, const MACAddr &src, const MACAddr &dst,
+		u_int64_t gen, time_t now) const
+{
+	u_int64_t s = src.key();
+	u_int64_t d = dst.key();
+
+	const Flow &f = table[hash(in, s, d)];
+
+	if(f.gen != gen || f.seen != (u_int32_t)now || f.in != in || f.src != s
+			|| f.dst != d)
+		return NULL;
+
+	return f.out;
+}
+
+void FlowCache::insert(const Port *in, const MACAddr &src, const MACAddr &dst,
+		Port *out, u_int64_t gen, time_t now)
+{
+	u_int64_t s = src.key();
+	u_int64_t d = dst.key();
+
+	Flow &f = table[hash(in, s, d)];
+
+	f.src = s;
+	f.dst = d;
+	f.in = in;
+	f.out = out;
+	f.gen = gen;
+	f.seen = now;
+}
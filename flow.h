@@ -0,0 +1,77 @@
+//===================================================================
+// File:        flow.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Per-thread exact-match flow cache
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _FLOW_H_
+#define _FLOW_H_
+
+
+#include "mac.h"
+#include "port.h"
+
+#include <sys/types.h>
+
+#include <ctime>
+
+
+#if FLOW_CACHE_SIZE <= 0
+# 	define FLOW_CACHE_SIZE 				1024 	// flows, power of 2
+#endif
+
+
+// Direct-mapped (ingress, source, destination) -> egress cache owned by
+// one forwarding thread. A flow is valid for the CAM generation it was
+// resolved in and for one second, so active addresses still get their
+// CAM timestamps refreshed.
+class FlowCache
+{
+private:
+	struct Flow
+	{
+		u_int64_t src, dst;
+		const Port *in;
+		Port *out;
+		u_int64_t gen;
+		u_int32_t seen;
+	};
+private:
+	Flow table[FLOW_CACHE_SIZE];
+private:
+	static size_t hash(const Port *in, u_int64_t src, u_int64_t dst);
+public:
+	FlowCache();
+
+	Port * find(const Port *in, const MACAddr &src, const MACAddr &dst,
+			u_int64_t gen, time_t now) const;
+	void insert(const Port *in, const MACAddr &src, const MACAddr &dst,
+			Port *out, u_int64_t gen, time_t now);
+};
+
+
+#endif /* _FLOW_H_ */
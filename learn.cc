@@ -0,0 +1,104 @@
+//===================================================================
+// File:        learn.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Asynchronous MAC learning
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "learn.h"
+
+
+Learner Learner::lrn;
+
+
+Learner::Learner()
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+Learner & Learner::instance()
+{
+	return lrn;
+}
+
+void Learner::post(LearnQueue *q, const MACAddr &mac, Port *p)
+{
+	CAMLearn l;
+
+	l.mac = mac;
+	l.port = p;
+
+	q->push(l); 											// full: next frame will retry
+}
+
+Learner::~Learner()
+{
+	std::vector<LearnQueue *>::iterator it = queues.begin();
+
+	for(; it != queues.end(); ++it)
+		delete *it;
+}
+
+LearnQueue * Learner::attach()
+{
+	LearnQueue *q = new LearnQueue(LEARN_QUEUE_SIZE);
+
+	pthread_mutex_lock(&lock);
+
+	queues.push_back(q);
+
+	pthread_mutex_unlock(&lock);
+
+	return q;
+}
+
+// One batch per queue and round, so a busy port cannot starve the others.
+size_t Learner::drain()
+{
+	CAMTable &cam = CAMTable::instance();
+
+	CAMLearn batch[LEARN_BATCH];
+	size_t total = 0;
+
+	pthread_mutex_lock(&lock);
+
+	std::vector<LearnQueue *>::iterator it = queues.begin();
+
+	for(; it != queues.end(); ++it)
+	{
+		size_t n = (*it)->pop(batch, LEARN_BATCH);
+
+		if(n == 0) continue;
+
+		cam.learnBatch(batch, n);
+
+		total += n;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return total;
+}
@@ -0,0 +1,83 @@
+//===================================================================
+// File:        learn.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Asynchronous MAC learning
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _LEARN_H_
+#define _LEARN_H_
+
+
+#include "mac.h"
+#include "port.h"
+#include "cam.h"
+#include "ring.h"
+
+#include <pthread.h>
+
+#include <vector>
+
+
+#if LEARN_QUEUE_SIZE <= 0
+# 	define LEARN_QUEUE_SIZE 			1024
+#endif
+
+#if LEARN_BATCH <= 0
+# 	define LEARN_BATCH 						64
+#endif
+
+#if LEARN_IDLE <= 0
+# 	define LEARN_IDLE 						1000 	// usec
+#endif
+
+
+typedef Ring<CAMLearn> LearnQueue;
+
+// Forwarding threads post learn/move events only for sources not yet
+// known on the ingress port, the learner thread applies them to the CAM
+// table in batches.
+class Learner
+{
+private:
+	static Learner lrn;
+private:
+	pthread_mutex_t lock;
+	std::vector<LearnQueue *> queues;
+private:
+	Learner();
+public: 	// static //
+	static Learner & instance();
+	static void post(LearnQueue *q, const MACAddr &mac, Port *p);
+public:
+	~Learner();
+public: 	// concurrent //
+	LearnQueue * attach(); 						// once per forwarding thread
+	size_t drain(); 									// learner thread
+};
+
+
+#endif /* _LEARN_H_ */
@@ -0,0 +1,316 @@
+//===================================================================
+// File:        loop.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Event-loop forwarding threads
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "loop.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cassert>
+#include <cstring>
+#include <ctime>
+
+
+EventLoop EventLoop::lp;
+
+
+inline static u_int64_t MSEC()
+{
+	timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+
+EventLoop::EventLoop()
+:
+	last(0), err("")
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+EventLoop::~EventLoop()
+{
+	for(size_t i = 0; i < wk.size(); ++i)
+	{
+		close(wk[i]->ep);
+		delete wk[i];
+	}
+
+	for(size_t i = 0; i < ports.size(); ++i)
+		delete ports[i];
+}
+
+EventLoop & EventLoop::instance()
+{
+	return lp;
+}
+
+bool EventLoop::fail(const char *what)
+{
+	err = std::string("EventLoop(): ") + what + "(): " + strerror(errno);
+
+	return false;
+}
+
+const std::string & EventLoop::error() const
+{
+	return err;
+}
+
+// Receivers are dealt out in port order, a port's receivers go to
+// different workers.
+bool EventLoop::setup(size_t workers)
+{
+	InterfaceStack &ifs = InterfaceStack::instance();
+
+	if(workers == 0 || workers > LOOP_WORKERS_MAX)
+	{
+		err = "EventLoop(): bad number of workers";
+		return false;
+	}
+
+	for(size_t i = 0; i < workers; ++i)
+	{
+		int ep = epoll_create1(EPOLL_CLOEXEC);
+
+		if(ep == -1)
+			return fail("epoll_create1");
+
+		Worker *w = new Worker;
+
+		w->ep = ep;
+		w->got = 0;
+
+		wk.push_back(w);
+	}
+
+	for(size_t i = 0; i < ifs.size(); ++i)
+		for(size_t w = 0; w < ifs[i]->workers(); ++w)
+		{
+			LoopPort *p = new LoopPort;
+
+			p->iface = ifs[i];
+			p->worker = w;
+			p->owner = ports.size() % workers;
+			p->busy = 0;
+			p->frames = p->mark = p->moves = 0;
+
+			ports.push_back(p);
+
+			try
+			{
+				p->fd = ifs[i]->nonblock(w);
+			}
+			catch(const std::string &str)
+			{
+				err = std::string("EventLoop(): ") + ifs[i]->name() + ": " + str;
+				return false;
+			}
+
+			epoll_event ev;
+
+			ev.events = EPOLLIN;
+			ev.data.ptr = p;
+
+			if(epoll_ctl(wk[p->owner]->ep, EPOLL_CTL_ADD, p->fd, &ev) == -1)
+				return fail("epoll_ctl");
+		}
+
+	return true;
+}
+
+size_t EventLoop::workers() const
+{
+	return wk.size();
+}
+
+// Returns receivers the worker still owns, a readiness reported before
+// a move is dropped by the old owner.
+size_t EventLoop::wait(size_t w, LoopPort **ready, size_t n)
+{
+	epoll_event ev[LOOP_EVENTS];
+
+	if(n > LOOP_EVENTS)
+		n = LOOP_EVENTS;
+
+	if(wk[w]->got == 0) 							// woken for nothing
+		balance(w);
+
+	wk[w]->got = 0;
+
+	for(;;)
+	{
+		int m = epoll_wait(wk[w]->ep, ev, n, LOOP_IDLE);
+
+		if(m == 0)
+			balance(w);
+
+		size_t k = 0;
+
+		for(int i = 0; i < m; ++i)
+		{
+			LoopPort *p = (LoopPort *)ev[i].data.ptr;
+
+			if(__atomic_exchange_n(&p->busy, 1, __ATOMIC_ACQUIRE))
+				continue;
+
+			if(p->owner != w)
+			{
+				__atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+				continue;
+			}
+
+			ready[k++] = p;
+		}
+
+		if(k) return k;
+	}
+}
+
+void EventLoop::done(LoopPort *p, size_t frames)
+{
+	wk[p->owner]->got += frames;
+
+	__atomic_store_n(&p->frames, p->frames + frames, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+}
+
+bool EventLoop::move(LoopPort *p, size_t to)
+{
+	if(__atomic_exchange_n(&p->busy, 1, __ATOMIC_ACQUIRE))
+		return false;
+
+	epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = p;
+
+	bool ok = epoll_ctl(wk[to]->ep, EPOLL_CTL_ADD, p->fd, &ev) == 0;
+
+	if(ok)
+	{
+		epoll_ctl(wk[p->owner]->ep, EPOLL_CTL_DEL, p->fd, NULL);
+
+		__atomic_store_n(&p->owner, to, __ATOMIC_RELAXED);
+		++p->moves;
+	}
+
+	__atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+
+	return ok;
+}
+
+// Rates are frames since the previous round. The busiest worker with more
+// than one receiver keeps its hottest one and gives up the next. Owners
+// only change here, under the lock.
+void EventLoop::balance(size_t w)
+{
+	if(wk.size() < 2 || pthread_mutex_trylock(&lock))
+		return;
+
+	u_int64_t now = MSEC();
+
+	if(now - last < LOOP_BALANCE)
+	{
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	last = now;
+
+	std::vector<unsigned long> load(wk.size(), 0);
+	std::vector<size_t> owned(wk.size(), 0);
+	std::vector<unsigned long> rate(ports.size());
+
+	for(size_t i = 0; i < ports.size(); ++i)
+	{
+		unsigned long f = __atomic_load_n(&ports[i]->frames, __ATOMIC_RELAXED);
+
+		rate[i] = f - ports[i]->mark;
+		ports[i]->mark = f;
+
+		load[ports[i]->owner] += rate[i];
+		++owned[ports[i]->owner];
+	}
+
+	size_t v = w;
+
+	for(size_t i = 0; i < wk.size(); ++i)
+		if(i != w && owned[i] > 1 && (v == w || load[i] > load[v]))
+			v = i;
+
+	if(v != w && load[v] > load[w])
+	{
+		size_t hot = ports.size(), next = ports.size();
+
+		for(size_t i = 0; i < ports.size(); ++i)
+		{
+			if(ports[i]->owner != v || rate[i] == 0)
+				continue;
+
+			if(hot == ports.size() || rate[i] > rate[hot])
+			{
+				next = hot;
+				hot = i;
+			}
+			else if(next == ports.size() || rate[i] > rate[next])
+				next = i;
+		}
+
+		if(next != ports.size())
+			move(ports[next], w);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+std::ostream & operator <<(std::ostream &os, const EventLoop &l)
+{
+	os << "Worker\tIface\t\tRx\tFrames\t\tMoves";
+
+	for(size_t w = 0; w < l.wk.size(); ++w)
+		for(size_t i = 0; i < l.ports.size(); ++i)
+		{
+			const LoopPort *p = l.ports[i];
+
+			if(__atomic_load_n(&p->owner, __ATOMIC_RELAXED) != w)
+				continue;
+
+			os << std::endl << w << "\t" << p->iface->name() << "\t\t" << p->worker
+				<< "\t" << __atomic_load_n(&p->frames, __ATOMIC_RELAXED) << "\t\t"
+				<< p->moves;
+		}
+
+	return os;
+}
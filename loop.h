@@ -0,0 +1,116 @@
+//===================================================================
+// File:        loop.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Event-loop forwarding threads
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+
+#include "port.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+
+#if LOOP_EVENTS <= 0
+# 	define LOOP_EVENTS 								16 		// ready receivers per wait
+#endif
+
+#if LOOP_IDLE <= 0
+# 	define LOOP_IDLE 									10 		// ms without frames, then steal
+#endif
+
+#if LOOP_BALANCE <= 0
+# 	define LOOP_BALANCE 							100 	// ms between balancing rounds
+#endif
+
+#define LOOP_WORKERS_MAX 							256
+
+
+// A receiver of an interface as the loop sees it. Only its owner waits
+// on it, busy is held while a worker reads it or moves it.
+struct LoopPort
+{
+	Interface *iface;
+	size_t worker; 										// receiver of iface
+	int fd;
+	unsigned owner;
+	unsigned busy;
+	unsigned long frames; 						// by whoever owns it
+	unsigned long mark; 							// frames at the last balance
+	unsigned long moves;
+} __attribute__((aligned(CACHE_LINE)));
+
+// Every receiver of every port is owned by one of a fixed set of workers,
+// which waits on its receivers with epoll and takes a burst from each
+// ready one in turn. A worker that forwarded nothing in its last round,
+// or waited LOOP_IDLE ms for it, takes the second busiest receiver of
+// the busiest worker, so two hot ports end up on different workers.
+class EventLoop
+{
+private:
+	static EventLoop lp;
+private:
+	struct Worker
+	{
+		int ep;
+		unsigned long got; 							// frames this round
+	} __attribute__((aligned(CACHE_LINE)));
+private:
+	std::vector<LoopPort *> ports;
+	std::vector<Worker *> wk;
+	pthread_mutex_t lock; 						// balancing
+	u_int64_t last; 									// ms, last move
+	std::string err;
+private:
+	EventLoop();
+	bool fail(const char *what);
+	void balance(size_t w);
+	bool move(LoopPort *p, size_t to);
+public:
+	static EventLoop & instance();
+public:
+	~EventLoop();
+public: 	// init //
+	bool setup(size_t workers); 			// after InterfaceStack::open()
+	const std::string & error() const;
+	size_t workers() const;
+public: 	// concurrent (worker thread w) //
+	size_t wait(size_t w, LoopPort **ready, size_t n); 	// each busy
+	void done(LoopPort *p, size_t frames);
+
+	friend std::ostream & operator <<(std::ostream &os, const EventLoop &l);
+};
+
+
+#endif /* _LOOP_H_ */
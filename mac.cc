@@ -103,6 +103,16 @@ bool MACAddr::isMulticast() const
 	return (addr[0] == 0x01 && addr[1] == 0x00 && addr[2] == 0x5E);
 }
 
+u_int64_t MACAddr::key() const
+{
+	u_int64_t k = 0;
+
+	for(size_t i = 0; i < sizeof(addr); ++i)
+		k = (k << 8) | addr[i];
+
+	return k;
+}
+
 std::ostream & operator <<(std::ostream &os, const MACAddr &m)
 {
 	std::ios_base::fmtflags flags = os.setf(std::ios::hex, std::ios::basefield);
@@ -55,6 +55,8 @@ public:
 	bool isBroadcast() const;
 	bool isMulticast() const;
 
+	u_int64_t key() const; 						// 48-bit integer
+
 	friend std::ostream & operator <<(std::ostream &os, const MACAddr &m);
 };
 
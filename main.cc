@@ -31,17 +31,35 @@
 
 #include "mac.h"
 #include "port.h"
+#include "clock.h"
 #include "cam.h"
+#include "learn.h"
+#include "epoch.h"
+#include "snapshot.h"
+#include "fastpath.h"
+#include "flow.h"
+#include "loop.h"
+#include "affinity.h"
+#include "driver.h"
+#include "pool.h"
+#include "packet.h"
+#include "xdp.h"
+#include "uring.h"
 
 #include <sys/types.h>
+#include <poll.h>
 
 #include <libnet.h>
 
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <cctype>
 
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <map>
 #include <cassert>
 
 
@@ -60,25 +78,119 @@ extern int optind, opterr, optopt;
 
 static const char *progName;
 
+static Snapshot *snapshot = NULL;
+static int snapshotInterval = DEFAULT_SNAPSHOT;
+static bool fastPath = false;
 
+
+// Periodic jobs, each on its own timer. A late wakeup runs a job once
+// for all the periods it missed. The jobs take locks and write the
+// snapshot, the thread is only cancelled between them.
 void * cleaner(void *data)
 {
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
 	CAMTable &cam = CAMTable::instance();
-	MulticastStack &ms = MulticastStack::instance();
+	Epoch &ep = Epoch::instance();
+
+	Affinity::instance().place("cleaner");
+
+	Timer *tick, *aging, *save;
+
+	try
+	{
+		tick = new Timer(1);
+		aging = new Timer((long)data);
+		save = new Timer(snapshotInterval);
+	}
+	catch(const std::string &str)
+	{
+		cerr << "ERROR: " << str << endl;
+
+		pthread_exit(NULL);
+	}
+
+	pollfd p[3];
+
+	p[0].fd = tick->descriptor();
+	p[1].fd = aging->descriptor();
+	p[2].fd = save->descriptor();
+
+	for(int i = 0; i < 3; ++i)
+		p[i].events = POLLIN;
 
 	for(;;)
 	{
-		sleep((long)data);
-		cam.cleanup();
-		ms.cleanup();
+		if(poll(p, 3, -1) <= 0)
+			continue;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if(tick->expired())
+		{
+			CoarseClock::tick();
+			ep.reclaim();
+
+			if(fastPath)
+				FastPath::instance().sync();
+		}
+
+		if(aging->expired())
+			cam.cleanup();
+
+		if(save->expired() && snapshot && !snapshot->save())
+			cerr << "ERROR: " << snapshot->error() << endl;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	}
 
 	pthread_exit(NULL);
 }
 
+void * learner(void *data)
+{
+	(void)data;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	Learner &lrn = Learner::instance();
+	CAMTable &cam = CAMTable::instance();
+
+	Affinity::instance().place("learner");
+
+	for(;;)
+	{
+		bool busy = lrn.drain() != 0;
+
+		busy |= cam.rehash(); 					// a step each round, learning or not
+
+		if(!busy)
+			usleep(LEARN_IDLE);
+	}
+
+	pthread_exit(NULL);
+}
+
+void * transmitter(void *data)
+{
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	Interface *iface = InterfaceStack::instance()[(long)data];
+
+	assert(iface != NULL);
+
+	Affinity::instance().place(std::string("tx ") + iface->name());
+
+	for(;;)
+		if(!iface->drain())
+			iface->idle();
+
+	pthread_exit(NULL);
+}
+
 void snoopIGMP(Interface *iface, const u_int8_t *frame, size_t len)
 {
 	MulticastStack &mcstack = MulticastStack::instance();
@@ -102,10 +214,7 @@ void snoopIGMP(Interface *iface, const u_int8_t *frame, size_t len)
 			if(iface->same(mcstack.getQuerier()))
 				break;
 
-			Multicast *mc = mcstack[igmp->igmp_group.s_addr];
-
-			if(mc != NULL)
-				mc->add(iface);
+			mcstack.join(igmp->igmp_group.s_addr, iface);
 
 			mcstack.sendResponse(frame, len, iface);
 
@@ -113,9 +222,7 @@ void snoopIGMP(Interface *iface, const u_int8_t *frame, size_t len)
 		}
 		case IGMP_LEAVE_GROUP:
 		{
-			Multicast *mc = mcstack.find(igmp->igmp_group.s_addr);
-
-			if(mc != NULL) mc->remove(iface);
+			mcstack.leave(igmp->igmp_group.s_addr, iface);
 
 
 			// !!! SEND TO QUERIER and OTHERS ??? !!!
@@ -133,40 +240,44 @@ void snoopIGMP(Interface *iface, const u_int8_t *frame, size_t len)
 			if(iface->same(mcstack.getQuerier()))
 				break;
 
-			Multicast *mc = mcstack[igmp->igmp_group.s_addr];
-
-			if(mc != NULL)
-				mc->add(iface);
+			mcstack.join(igmp->igmp_group.s_addr, iface);
 
 			break;
 		}
 	}
 }
 
-void * traffic(void *data)
+// Forwards a burst received on iface. The batch is flushed before
+// returning, the next recv() on the receiver reuses the frames.
+void forward(Interface *iface, const Frame *rx, size_t n, LearnQueue *lq,
+		EpochRecord *er, FlowCache &fc, TxBatch &tx)
 {
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-
 	CAMTable &cam = CAMTable::instance();
-	InterfaceStack &ifs = InterfaceStack::instance();
 	MulticastStack &mcstack = MulticastStack::instance();
 
-	Interface *iface = ifs[(long)data];
+	Port *out[RX_BURST_MAX];
+	bool known[RX_BURST_MAX];
 
-	assert(iface != NULL);
+	MACAddr dst[RX_BURST_MAX];
+	Port *res[RX_BURST_MAX];
+	size_t miss[RX_BURST_MAX];
+	size_t m = 0;
 
-	for(;;)
+	Epoch::enter(er);
+
+	u_int64_t gen = cam.generation();
+	time_t now = CoarseClock::now();
+
+	for(size_t i = 0; i < n; ++i)
 	{
-		size_t len;
-		const u_int8_t *frame;
+		const u_int8_t *frame = rx[i].data;
+		size_t len = rx[i].len;
 		EtherHeader eth;
-	 
-		if((frame = iface->recv(&len)) == NULL)
-			continue;
 
 		eth.set(frame);
 
+		out[i] = NULL;
+
 		// IPv4 MULTICAST
 		if(eth.destination().isMulticast() && eth.type() == ETHERTYPE_IP)
 		{
@@ -184,19 +295,162 @@ void * traffic(void *data)
 					Multicast *mc = mcstack.find(group);
 
 					if(mc != NULL)
-						mc->send(frame, len, iface);
+						out[i] = mc;
 					else
-						Broadcast::instance().send(frame, len, iface);
+						out[i] = &Broadcast::instance();
 				}
 			}
 		}
 		// UNICAST, BROADCAST
 		else
 		{
-			cam.insert(eth.source(), iface);
-			Port *p = cam.find(eth.destination());
+			out[i] = fc.find(iface, eth.source(), eth.destination(), gen, now);
+
+			if(out[i] != NULL)
+				continue;
+
+			CAMTable::Source src = cam.source(eth.source(), iface);
+
+			if(src == CAMTable::BLOCK)
+				continue;
+
+			if(src == CAMTable::LEARN)
+				Learner::post(lq, eth.source(), iface);
+
+			known[i] = src == CAMTable::KNOWN;
+			dst[m] = eth.destination();
+			miss[m++] = i;
+		}
+	}
+
+	// Destinations missed by the flow cache are resolved together, their
+	// CAM lookups overlap.
+
+	cam.findBatch(dst, res, m);
+
+	for(size_t k = 0; k < m; ++k)
+	{
+		size_t i = miss[k];
+
+		out[i] = res[k];
+
+		if(out[i] != NULL && known[i])
+		{
+			EtherHeader eth;
+
+			eth.set(rx[i].data);
+
+			fc.insert(iface, eth.source(), dst[k], out[i], gen, now);
+		}
+	}
+
+	for(size_t i = 0; i < n; ++i)
+		if(out[i] != NULL)
+			out[i]->send(rx[i], iface);
+
+	tx.flush();
+
+	Epoch::leave(er);
+}
+
+// One receiver of an interface, by producer number.
+void * traffic(void *data)
+{
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	InterfaceStack &ifs = InterfaceStack::instance();
+
+	Interface *iface = NULL;
+	size_t worker = (long)data;
+
+	for(size_t i = 0; iface == NULL && i < ifs.size(); ++i)
+		if(worker < ifs[i]->workers())
+			iface = ifs[i];
+		else
+			worker -= ifs[i]->workers();
+
+	assert(iface != NULL);
+
+	ostringstream name;
+
+	name << "rx " << iface->name();
+
+	if(iface->workers() > 1)
+		name << ":" << worker;
+
+	Affinity::instance().place((long)data, name.str()); 	// before allocating
+
+	LearnQueue *lq = Learner::instance().attach();
+	EpochRecord *er = Epoch::instance().attach();
+	FlowCache fc;
+	TxBatch tx(ifs.size(), iface->producer(worker));
+
+	tx.attach();
+
+	BusyPoll bp(iface->pollStats(worker));
+	bool busy = iface->polling(worker);
+
+	for(;;)
+	{
+		const Frame *rx;
+		size_t n = iface->recv(worker, &rx);
+
+		if(n && !iface->isDown())
+			forward(iface, rx, n, lq, er, fc, tx);
+
+		if(busy)
+			bp.polled(n);
+	}
+
+	pthread_exit(NULL);
+}
+
+// An event-loop worker, one burst from each ready receiver it owns.
+void * poller(void *data)
+{
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	InterfaceStack &ifs = InterfaceStack::instance();
+	EventLoop &loop = EventLoop::instance();
+
+	size_t w = (long)data;
+
+	ostringstream name;
+
+	name << "loop " << w;
+
+	Affinity::instance().place(w, name.str());
+
+	LearnQueue *lq = Learner::instance().attach();
+	EpochRecord *er = Epoch::instance().attach();
+	FlowCache fc;
+	TxBatch tx(ifs.size(), 0);
+
+	tx.attach();
+
+	LoopPort *ready[LOOP_EVENTS];
+
+	for(;;)
+	{
+		size_t m = loop.wait(w, ready, LOOP_EVENTS);
+
+		for(size_t k = 0; k < m; ++k)
+		{
+			LoopPort *p = ready[k];
+
+			const Frame *rx;
+			size_t n = p->iface->recv(p->worker, &rx);
 
-			p->send(frame, len, iface);
+			if(n && !p->iface->isDown())
+			{
+				tx.from(p->iface->producer(p->worker));
+
+				forward(p->iface, rx, n, lq, er, fc, tx);
+			}
+
+			loop.done(p, n);
 		}
 	}
 
@@ -204,6 +458,77 @@ void * traffic(void *data)
 }
 
 
+size_t parseSize(const char *s) 		// bytes, k/M/G suffix
+{
+	char *end;
+
+	unsigned long long n = strtoull(s, &end, 10);
+
+	switch(*end)
+	{
+		case 'G': case 'g':
+			n <<= 10;
+			// fall through
+		case 'M': case 'm':
+			n <<= 10;
+			// fall through
+		case 'K': case 'k':
+			n <<= 10;
+			++end;
+	}
+
+	if(end == s || *end != '\0')
+		return 0;
+
+	return n;
+}
+
+// IFACE:driver[,key=val...]
+bool parseIface(const char *s, string &name, DriverConfig &c)
+{
+	const char *p = strchr(s, ':');
+
+	if(p == NULL || p == s)
+		return false;
+
+	name.assign(s, p - s);
+
+	string opts(p + 1);
+
+	size_t b = 0, e;
+
+	for(bool first = true; b <= opts.size(); b = e + 1, first = false)
+	{
+		if((e = opts.find(',', b)) == string::npos)
+			e = opts.size();
+
+		string kv = opts.substr(b, e - b);
+
+		if(first)
+		{
+			if(kv.empty()) return false;
+
+			c.type = kv;
+
+			continue;
+		}
+
+		size_t q = kv.find('=');
+
+		if(q == string::npos || q == 0)
+			return false;
+
+		size_t v = parseSize(kv.c_str() + q + 1);
+
+		if(v == 0 && kv.substr(q + 1) != "0")
+			return false;
+
+		c.opt[kv.substr(0, q)] = v;
+	}
+
+	return true;
+}
+
 void usage(ostream &stream, int ecode)
 {
 	stream << "USAGE: " << progName << " [OPTIONS]" << endl;
@@ -221,6 +546,75 @@ void help(ostream &stream, int ecode)
 		<< DEFAULT_MIN_TTL << ")" << endl;
 	stream << "    -c sec    CAM table cleanup interval ("
 		<< DEFAULT_CAM_CLEANUP << ")" << endl;
+	stream << "    -s num    Initial CAM table entries (" << CAM_TABLE_SIZE << ")"
+		<< endl;
+	stream << "    -m size   CAM table memory budget with k/M/G suffix, the table"
+		<< endl;
+	stream << "              grows on demand up to it (none, fixed size)" << endl;
+	stream << "    -e pol    CAM table replacement policy when full:" << endl;
+	stream << "              none, lru, clock (lru)" << endl;
+	stream << "    -D m:w:h  MAC flap damping: m moves within w seconds hold the"
+		<< endl;
+	stream << "              address for h seconds, 0 disables (" << DEFAULT_FLAP_MOVES
+		<< ":" << DEFAULT_FLAP_WINDOW << ":" << DEFAULT_FLAP_HOLD << ")" << endl;
+	stream << "    -q        Quarantine flapping addresses instead of pinning them"
+		<< endl;
+	stream << "    -l num    Maximum learned addresses per port (unlimited)"
+		<< endl;
+	stream << "    -r num    Maximum learns per second per port (unlimited)" << endl;
+	stream << "    -L act    Port over its limit: learn (drop the learn), frame"
+		<< endl;
+	stream << "              (drop the frame), shut (error-disable) (learn)" << endl;
+	stream << "    -f file   Warm start: restore the CAM table from file and save"
+		<< endl;
+	stream << "              it there periodically and on quit" << endl;
+	stream << "    -S sec    Snapshot interval (" << DEFAULT_SNAPSHOT << ")" << endl;
+	stream << "    -g        Include IGMP group memberships in the snapshot" << endl;
+	stream << "    -b num    Frames received per call, at most " << RX_BURST_MAX
+		<< " (" << RX_BURST << ")" << endl;
+	stream << "    -Q d[:p]  Per-port TX workers, d frames queued per receiver, 0 sends"
+		<< endl;
+	stream << "              from the ingress thread; full queues drop or wait ("
+		<< TXQ_DEPTH << ":drop)" << endl;
+	stream << "    -B num    Frame buffers for queued frames (" << POOL_BUFS << " of "
+		<< POOL_BUF_SIZE << " B)" << endl;
+	stream << "    -H        Frame buffers on 2 MB hugepages" << endl;
+	stream << "    -i spec   Port backend, IFACE:driver[,key=val...], repeatable:"
+		<< endl;
+	stream << "              pcap (default)" << endl;
+	stream << "              packet  AF_PACKET mmap rings, blocks=" << RING_BLOCKS
+		<< ",block=" << RING_BLOCK_SIZE << "," << endl;
+	stream << "                      frame=" << RING_FRAME_SIZE << ",tx="
+		<< RING_TX_FRAMES << ",timeout=" << RING_TIMEOUT << " (ms)" << endl;
+	stream << "              xdp     AF_XDP socket, queue=0,ring=" << XSK_RING_SIZE
+		<< ",frames=" << XSK_RX_FRAMES << "," << endl;
+	stream << "                      tx=" << XSK_TX_FRAMES << ",zc=0|1,skb=1, umem="
+		<< XSK_UMEM_FRAMES << " and frame=" << XSK_FRAME_SIZE << endl;
+	stream << "                      of the first xdp port size the shared memory"
+		<< endl;
+	stream << "              uring   io_uring on a packet socket, entries="
+		<< URING_ENTRIES << ",bufs=" << URING_BUFS << "," << endl;
+	stream << "                      buf=" << URING_BUF_SIZE << endl;
+	stream << "              workers=1 receivers sharing the port by flow hash, all"
+		<< endl;
+	stream << "                      but xdp, at most " << RX_WORKERS_MAX << endl;
+	stream << "    -w num    Forward on num event-loop threads sharing all receivers,"
+		<< endl;
+	stream << "              0 runs a thread per receiver (0)" << endl;
+	stream << "    -C list   Pin forwarding threads to these cores in turn, e.g. 2,4-7;"
+		<< endl;
+	stream << "              the other threads keep off them" << endl;
+	stream << "    -R prio   Real-time mode, SCHED_FIFO forwarding threads at prio and"
+		<< endl;
+	stream << "              all memory locked" << endl;
+	stream << "    -P usec   Busy-poll mode, receivers never block and back off when"
+		<< endl;
+	stream << "              idle; usec > 0 also busy-polls the device in the kernel"
+		<< endl;
+	stream << "              where the driver can (xdp)" << endl;
+	stream << "    -x        Forward known unicast between xdp ports in the kernel,"
+		<< endl;
+	stream << "              " << FAST_FDB_SIZE << " addresses at most" << endl;
 	stream << "    -h        Show this help and exit" << endl;
 	stream << endl;
 	stream << "Software switch with multicast support.";
@@ -237,9 +631,33 @@ int main(int argc, char **argv)
 
 	int optMinTTL = DEFAULT_MIN_TTL;
 	int optCleanup = DEFAULT_CAM_CLEANUP;
+	CAMTable::Policy optPolicy = CAMTable::LRU;
+	long optEntries = CAM_TABLE_SIZE;
+	size_t optBudget = 0;
+	const char *optSnapshot = NULL;
+	bool optGroups = false;
+	unsigned optFlapMoves = DEFAULT_FLAP_MOVES;
+	unsigned optFlapWindow = DEFAULT_FLAP_WINDOW;
+	unsigned optFlapHold = DEFAULT_FLAP_HOLD;
+	bool optQuarantine = false;
+	long optPortMax = 0;
+	long optPortRate = 0;
+	CAMTable::Limit optLimit = CAMTable::DROP_LEARN;
+	long optBurst = RX_BURST;
+	size_t optTxDepth = TXQ_DEPTH;
+	bool optTxWait = false;
+	long optPoolBufs = POOL_BUFS;
+	bool optHuge = false;
+	bool optPool = false; 						// -B or -H given
+	map<string, DriverConfig> optIfaces;
+	long optLoop = 0;
+	const char *optCores = NULL;
+	long optRealtime = 0;
+	bool optPoll = false;
+	long optBusy = 0;
 
 	int opt;
-	while((opt = getopt(argc, argv, "t:c:h")) != -1)
+	while((opt = getopt(argc, argv, "t:c:s:m:e:D:ql:r:L:f:S:gb:Q:B:Hi:w:C:R:P:xh")) != -1)
 		switch(opt)
 		{
 			case 't':
@@ -248,6 +666,127 @@ int main(int argc, char **argv)
 			case 'c':
 				optCleanup = atoi(optarg);
 				break;
+			case 's':
+				optEntries = atol(optarg);
+				break;
+			case 'm':
+				if((optBudget = parseSize(optarg)) == 0)
+				{
+					cerr << "ERROR: Invalid argument for -m parameter" << endl;
+					return 1;
+				}
+				break;
+			case 'e':
+				if(!strcmp(optarg, "none"))
+					optPolicy = CAMTable::KEEP;
+				else if(!strcmp(optarg, "lru"))
+					optPolicy = CAMTable::LRU;
+				else if(!strcmp(optarg, "clock"))
+					optPolicy = CAMTable::CLOCK;
+				else
+				{
+					cerr << "ERROR: Invalid argument for -e parameter" << endl;
+					return 1;
+				}
+				break;
+			case 'D':
+				if(!strcmp(optarg, "0"))
+					optFlapMoves = 0;
+				else if(sscanf(optarg, "%u:%u:%u", &optFlapMoves, &optFlapWindow,
+							&optFlapHold) != 3 || optFlapMoves > 255 || !optFlapWindow
+						|| !optFlapHold || optFlapWindow > 32767 || optFlapHold > 32767)
+				{
+					cerr << "ERROR: Invalid argument for -D parameter" << endl;
+					return 1;
+				}
+				break;
+			case 'q':
+				optQuarantine = true;
+				break;
+			case 'l':
+				optPortMax = atol(optarg);
+				break;
+			case 'r':
+				optPortRate = atol(optarg);
+				break;
+			case 'L':
+				if(!strcmp(optarg, "learn"))
+					optLimit = CAMTable::DROP_LEARN;
+				else if(!strcmp(optarg, "frame"))
+					optLimit = CAMTable::DROP_FRAME;
+				else if(!strcmp(optarg, "shut"))
+					optLimit = CAMTable::SHUTDOWN;
+				else
+				{
+					cerr << "ERROR: Invalid argument for -L parameter" << endl;
+					return 1;
+				}
+				break;
+			case 'f':
+				optSnapshot = optarg;
+				break;
+			case 'S':
+				snapshotInterval = atoi(optarg);
+				break;
+			case 'g':
+				optGroups = true;
+				break;
+			case 'b':
+				optBurst = atol(optarg);
+				break;
+			case 'Q':
+			{
+				const char *p = strchr(optarg, ':');
+
+				if(!isdigit(*optarg) || (p && strcmp(p, ":drop")
+							&& strcmp(p, ":wait")))
+				{
+					cerr << "ERROR: Invalid argument for -Q parameter" << endl;
+					return 1;
+				}
+
+				optTxDepth = strtoul(optarg, NULL, 10);
+				optTxWait = p && !strcmp(p, ":wait");
+				break;
+			}
+			case 'B':
+				optPoolBufs = atol(optarg);
+				optPool = true;
+				break;
+			case 'H':
+				optHuge = true;
+				optPool = true;
+				break;
+			case 'i':
+			{
+				string name;
+				DriverConfig dc;
+
+				if(!parseIface(optarg, name, dc))
+				{
+					cerr << "ERROR: Invalid argument for -i parameter" << endl;
+					return 1;
+				}
+
+				optIfaces[name] = dc;
+				break;
+			}
+			case 'w':
+				optLoop = atol(optarg);
+				break;
+			case 'C':
+				optCores = optarg;
+				break;
+			case 'R':
+				optRealtime = atol(optarg);
+				break;
+			case 'P':
+				optPoll = true;
+				optBusy = atol(optarg);
+				break;
+			case 'x':
+				fastPath = true;
+				break;
 			case 'h':
 				help(cout, 0);
 			case '?':
@@ -264,23 +803,132 @@ int main(int argc, char **argv)
 		cerr << "ERROR: Invalid argument for -c parameter" << endl;
 		return 1;
 	}
+	else if(optEntries <= 0)
+	{
+		cerr << "ERROR: Invalid argument for -s parameter" << endl;
+		return 1;
+	}
+	else if(optPortMax < 0)
+	{
+		cerr << "ERROR: Invalid argument for -l parameter" << endl;
+		return 1;
+	}
+	else if(optPortRate < 0)
+	{
+		cerr << "ERROR: Invalid argument for -r parameter" << endl;
+		return 1;
+	}
+	else if(snapshotInterval <= 0)
+	{
+		cerr << "ERROR: Invalid argument for -S parameter" << endl;
+		return 1;
+	}
+	else if(optBurst <= 0 || optBurst > RX_BURST_MAX)
+	{
+		cerr << "ERROR: Invalid argument for -b parameter" << endl;
+		return 1;
+	}
+	else if(optPoolBufs <= 0)
+	{
+		cerr << "ERROR: Invalid argument for -B parameter" << endl;
+		return 1;
+	}
+	else if(optPool && optTxDepth == 0)
+	{
+		cerr << "ERROR: -B and -H size the queues' buffers, -Q 0 has none" << endl;
+		return 1;
+	}
+	else if(optLoop < 0 || optLoop > LOOP_WORKERS_MAX)
+	{
+		cerr << "ERROR: Invalid argument for -w parameter" << endl;
+		return 1;
+	}
+	else if(optRealtime < 0 || optRealtime > sched_get_priority_max(SCHED_FIFO))
+	{
+		cerr << "ERROR: Invalid argument for -R parameter" << endl;
+		return 1;
+	}
+	else if(optBusy < 0)
+	{
+		cerr << "ERROR: Invalid argument for -P parameter" << endl;
+		return 1;
+	}
+	else if(optPoll && optLoop)
+	{
+		cerr << "ERROR: -P needs a thread per receiver, not -w" << endl;
+		return 1;
+	}
+
+	CoarseClock::tick();
 
 	CAMTable &cam = CAMTable::instance();
 
+	if(!cam.setCapacity(optEntries, optBudget))
+	{
+		cerr << "ERROR: CAM table of " << optEntries << " entries does not fit "
+			"the memory budget" << endl;
+		return 1;
+	}
+
 	cam.setDefaultPort(&Broadcast::instance());
 	cam.setMinTTL(optMinTTL);
+	cam.setPolicy(optPolicy);
+	cam.setDamping(optFlapMoves, optFlapWindow, optFlapHold, optQuarantine);
+	cam.setPortLimit(optPortMax, optPortRate, optLimit);
+
+	// PLACEMENT
+
+	Affinity &aff = Affinity::instance();
+
+	if(optCores && !aff.setCores(optCores))
+	{
+		cerr << "ERROR: " << aff.error() << endl;
+		return 1;
+	}
+
+	aff.setLoop(optLoop);
+	aff.setRealtime(optRealtime);
+
+	if(optRealtime && !aff.lockMemory())
+		cerr << "WARNING: " << aff.error() << endl;
+
+	FramePool &pool = FramePool::instance();
+
+	if(optTxDepth && !pool.setup(optPoolBufs, POOL_BUF_SIZE, optHuge))
+	{
+		cerr << "ERROR: " << pool.error() << endl;
+		return 1;
+	}
 
 	// INTERFACES
 
 	InterfaceStack &ifs = InterfaceStack::instance();
 
-	if(!ifs.error().empty())
+	if(!ifs.open(optIfaces))
 	{
 		cerr << "ERROR: " << ifs.error() << endl;
 		return 1;
 	}
 
 	size_t nthrds = ifs.size();
+	size_t nrecv = ifs.producers();
+
+	for(size_t i = 0; i < nthrds; ++i)
+		ifs[i]->setBurst(optBurst);
+
+	ifs.setQueues(optTxDepth, optTxWait);
+
+	for(size_t i = 0; optPoll && i < nthrds; ++i)
+		for(size_t w = 0; w < ifs[i]->workers(); ++w)
+			try
+			{
+				ifs[i]->busyPoll(w, optBusy);
+			}
+			catch(const std::string &e)
+			{
+				cerr << "ERROR: " << e << endl;
+				return 1;
+			}
 
 	if(nthrds < 2)
 	{
@@ -288,10 +936,39 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if(fastPath && !FastPath::instance().enable(ifs, FAST_FDB_SIZE))
+	{
+		cerr << "ERROR: " << FastPath::instance().error() << endl;
+		return 1;
+	}
+
+	EventLoop &loop = EventLoop::instance();
+
+	if(optLoop && !loop.setup(optLoop))
+	{
+		cerr << "ERROR: " << loop.error() << endl;
+		return 1;
+	}
+
+	size_t nfwd = optLoop ? optLoop : nrecv;
+
+	aff.place("main"); 							// the others inherit it
+
+	// WARM START
+
+	if(optSnapshot)
+	{
+		snapshot = new Snapshot(optSnapshot, optGroups);
+
+		if(!snapshot->restore())
+			cerr << "WARNING: " << snapshot->error() << endl;
+	}
+
 	// THREADS
 
-	pthread_t clnr;
-	pthread_t *threads = new pthread_t[nthrds];
+	pthread_t clnr, lrnr;
+	pthread_t *threads = new pthread_t[nfwd];
+	pthread_t *txThreads = new pthread_t[nthrds];
 
 	int rc;
 
@@ -301,8 +978,22 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	for(unsigned long i = 0; i < nthrds; ++i)
-		if((rc = pthread_create(&threads[i], NULL, traffic, (void *)i)))
+	if((rc = pthread_create(&lrnr, NULL, learner, NULL)))
+	{
+		cerr << "ERROR: pthread_create(): " << strerror(rc) << endl;
+		return 1;
+	}
+
+	for(unsigned long i = 0; optTxDepth && i < nthrds; ++i)
+		if((rc = pthread_create(&txThreads[i], NULL, transmitter, (void *)i)))
+		{
+			cerr << "ERROR: pthread_create(): " << strerror(rc) << endl;
+			return 1;
+		}
+
+	for(unsigned long i = 0; i < nfwd; ++i)
+		if((rc = pthread_create(&threads[i], NULL, optLoop ? poller : traffic,
+						(void *)i)))
 		{
 			cerr << "ERROR: pthread_create(): " << strerror(rc) << endl;
 			return 1;
@@ -329,11 +1020,47 @@ int main(int argc, char **argv)
 		if(cmd.empty())
 			continue;
 		else if(cmd == "stat")
-			cout << ifs << endl << endl;
+			cout << ifs << endl << endl << aff << endl << endl;
 		else if(cmd == "cam")
 			cout << cam << endl << endl;
 		else if(cmd == "igmp")
 			cout << igmp << endl << endl;
+		else if(cmd == "flap")
+		{
+			cam.showFlaps(cout);
+			cout << endl << endl;
+		}
+		else if(cmd == "ports")
+		{
+			cam.showPorts(cout);
+			cout << endl << endl;
+		}
+		else if(cmd == "queues")
+		{
+			ifs.showQueues(cout);
+			cout << endl << endl;
+		}
+		else if(cmd == "pool")
+			cout << pool << endl << endl;
+		else if(cmd == "fast")
+			cout << FastPath::instance() << endl << endl;
+		else if(cmd == "loop")
+			cout << loop << endl << endl;
+		else if(cmd == "polls")
+		{
+			ifs.showPolls(cout);
+			cout << endl << endl;
+		}
+		else if(!cmd.compare(0, 7, "enable "))
+		{
+			Interface *i = ifs.find(cmd.c_str() + 7);
+
+			if(i == NULL)
+				cerr << "ERROR: Invalid interface `" << cmd.substr(7) << "'" << endl
+					<< endl;
+			else
+				i->setDown(false);
+		}
 		else if(cmd == "quit")
 			break;
 		else if(cmd == "help")
@@ -343,6 +1070,14 @@ int main(int argc, char **argv)
 			cout << "stat    Show interface stats" << endl;
 			cout << "cam     Show CAM table content" << endl;
 			cout << "igmp    Show multicast info" << endl;
+			cout << "flap    Show MAC flap events" << endl;
+			cout << "ports   Show per-port CAM usage and limits" << endl;
+			cout << "queues  Show TX queue occupancy and drops" << endl;
+			cout << "pool    Show frame buffer pool usage" << endl;
+			cout << "fast    Show in-kernel forwarding state" << endl;
+			cout << "loop    Show event-loop workers and their receivers" << endl;
+			cout << "polls   Show busy-poll receivers and where their time goes" << endl;
+			cout << "enable  Re-enable a shut down port: enable IFACE" << endl;
 			cout << "help    Show this help" << endl;
 			cout << "quit    Exit" << endl;
 			cout << endl;
@@ -352,11 +1087,22 @@ int main(int argc, char **argv)
 	}
 
 	pthread_cancel(clnr);
+	pthread_join(clnr, NULL); 				// not in its own save
+
+	if(snapshot && !snapshot->save())
+		cerr << "ERROR: " << snapshot->error() << endl;
 
-	for(unsigned long i = 0; i < nthrds; ++i)
+	pthread_cancel(lrnr);
+
+	for(unsigned long i = 0; i < nfwd; ++i)
 		pthread_cancel(threads[i]);
 
+	for(unsigned long i = 0; optTxDepth && i < nthrds; ++i)
+		pthread_cancel(txThreads[i]);
+
 	delete [] threads;
+	delete [] txThreads;
+	delete snapshot;
 
 	//pthread_exit(NULL);
 
@@ -0,0 +1,414 @@
+//===================================================================
+// File:        packet.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    AF_PACKET mmap ring backend
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "packet.h"
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+
+
+inline static std::string ERR(const char *call)
+{
+	return std::string(call) + "(): " + strerror(errno);
+}
+
+inline static bool POW2(size_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+inline static u_int8_t * MAP(int fd, size_t size)
+{
+	void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, 0);
+
+	return m == MAP_FAILED ? NULL : (u_int8_t *)m;
+}
+
+inline static tpacket_block_desc * BLOCK(u_int8_t *ring, size_t size, size_t b)
+{
+	return (tpacket_block_desc *)(ring + b * size);
+}
+
+inline static size_t TX_DATA()
+{
+	return TPACKET2_HDRLEN - sizeof(sockaddr_ll);
+}
+
+
+PacketDriver::PacketDriver(const char *ifname, const DriverConfig &c)
+:
+	rxfd(-1), txfd(-1), iofd(-1), rxRing(NULL), refs(NULL), block(0), left(0),
+	pkt(NULL), done(false), tail(0), held(0), nowait(false), txRing(NULL),
+	txHead(0)
+{
+	c.check("blocks block frame tx timeout");
+
+	blocks = c.get("blocks", RING_BLOCKS);
+	blockSize = c.get("block", RING_BLOCK_SIZE);
+	frameSize = c.get("frame", RING_FRAME_SIZE);
+	txFrames = c.get("tx", RING_TX_FRAMES);
+
+	unsigned timeout = c.get("timeout", RING_TIMEOUT);
+
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if(!blocks || !blockSize || blockSize % page || !POW2(frameSize)
+			|| frameSize <= TX_DATA() || frameSize > blockSize || !txFrames)
+		throw std::string("invalid ring geometry");
+
+	pthread_mutex_init(&txLock, NULL);
+
+	refs = new unsigned[blocks];
+
+	memset(refs, 0, blocks * sizeof(unsigned));
+
+	unsigned ifindex = if_nametoindex(ifname);
+
+	if(ifindex == 0)
+		throw ERR("if_nametoindex");
+
+	int v;
+	sockaddr_ll ll;
+
+	memset(&ll, 0, sizeof(ll));
+
+	ll.sll_family = AF_PACKET;
+	ll.sll_ifindex = ifindex;
+
+	// RX, TPACKET_V3
+
+	if((rxfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) == -1)
+		throw ERR("socket");
+
+	tpacket_req3 rreq;
+
+	memset(&rreq, 0, sizeof(rreq));
+
+	rreq.tp_block_size = blockSize;
+	rreq.tp_block_nr = blocks;
+	rreq.tp_frame_size = frameSize;
+	rreq.tp_frame_nr = blockSize / frameSize * blocks;
+	rreq.tp_retire_blk_tov = timeout;
+
+	packet_mreq mr;
+
+	memset(&mr, 0, sizeof(mr));
+
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+
+	ll.sll_protocol = htons(ETH_P_ALL);
+
+	v = TPACKET_V3;
+
+	if(setsockopt(rxfd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == -1
+			|| setsockopt(rxfd, SOL_PACKET, PACKET_RX_RING, &rreq, sizeof(rreq)) == -1
+			|| (rxRing = MAP(rxfd, blocks * blockSize)) == NULL
+			|| bind(rxfd, (sockaddr *)&ll, sizeof(ll)) == -1
+			|| setsockopt(rxfd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr))
+				== -1)
+	{
+		std::string e = ERR("rx ring");
+
+		shut();
+
+		throw e;
+	}
+
+	// TX, TPACKET_V2 on a socket that receives nothing
+
+	size_t txBlock = frameSize < page ? page : frameSize;
+
+	txFrames = (txFrames + txBlock / frameSize - 1) / (txBlock / frameSize)
+		* (txBlock / frameSize);
+
+	tpacket_req treq;
+
+	memset(&treq, 0, sizeof(treq));
+
+	treq.tp_block_size = txBlock;
+	treq.tp_block_nr = txFrames * frameSize / txBlock;
+	treq.tp_frame_size = frameSize;
+	treq.tp_frame_nr = txFrames;
+
+	ll.sll_protocol = 0;
+
+	v = TPACKET_V2;
+
+	if((txfd = socket(AF_PACKET, SOCK_RAW, 0)) == -1
+			|| setsockopt(txfd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == -1
+			|| setsockopt(txfd, SOL_PACKET, PACKET_TX_RING, &treq, sizeof(treq)) == -1
+			|| (txRing = MAP(txfd, txFrames * frameSize)) == NULL
+			|| bind(txfd, (sockaddr *)&ll, sizeof(ll)) == -1
+			|| (iofd = socket(AF_PACKET, SOCK_RAW, 0)) == -1
+			|| bind(iofd, (sockaddr *)&ll, sizeof(ll)) == -1)
+	{
+		std::string e = ERR("tx ring");
+
+		shut();
+
+		throw e;
+	}
+}
+
+PacketDriver::~PacketDriver()
+{
+	shut();
+}
+
+void PacketDriver::shut()
+{
+	if(rxRing) munmap(rxRing, blocks * blockSize);
+	if(txRing) munmap(txRing, txFrames * frameSize);
+
+	if(rxfd != -1) close(rxfd);
+	if(txfd != -1) close(txfd);
+	if(iofd != -1) close(iofd);
+
+	delete [] refs;
+
+	rxRing = txRing = NULL;
+	rxfd = txfd = iofd = -1;
+	refs = NULL;
+}
+
+void PacketDriver::release(size_t b)
+{
+	__atomic_store_n(&BLOCK(rxRing, blockSize, b)->hdr.bh1.block_status,
+			TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+// Hands back the finished blocks nobody holds any more, oldest first.
+void PacketDriver::reclaim()
+{
+	while(held && __atomic_load_n(&refs[tail], __ATOMIC_ACQUIRE) == 0)
+	{
+		release(tail);
+
+		tail = (tail + 1) % blocks;
+		--held;
+	}
+}
+
+void PacketDriver::wait()
+{
+	pollfd p;
+
+	p.fd = rxfd;
+	p.events = POLLIN | POLLERR;
+	p.revents = 0;
+
+	poll(&p, 1, -1);
+}
+
+// Stops at the end of a block, the receiver holds at most one block it
+// has finished.
+size_t PacketDriver::recv(Frame *f, size_t n)
+{
+	if(done)
+	{
+		__atomic_sub_fetch(&refs[(block + blocks - 1) % blocks], 1,
+				__ATOMIC_RELEASE);
+
+		done = false;
+	}
+
+	reclaim();
+
+	bool copy = (held + 1) * 4 > blocks * 3; 	// ring nearly all held
+
+	size_t k = 0;
+
+	while(k < n)
+	{
+		if(left == 0)
+		{
+			if(held == blocks) 				// all still referenced
+			{
+				if(k || nowait) break;
+
+				usleep(RING_TIMEOUT * 1000);
+
+				reclaim();
+
+				continue;
+			}
+
+			tpacket_block_desc *bd = BLOCK(rxRing, blockSize, block);
+
+			if(!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+						& TP_STATUS_USER))
+			{
+				if(k || nowait) break;
+
+				wait();
+
+				continue;
+			}
+
+			left = bd->hdr.bh1.num_pkts;
+			pkt = (u_int8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+
+			__atomic_store_n(&refs[block], left ? 1 : 0, __ATOMIC_RELAXED);
+
+			if(left == 0)
+			{
+				block = (block + 1) % blocks;
+				++held;
+
+				continue;
+			}
+		}
+
+		tpacket3_hdr *h = (tpacket3_hdr *)pkt;
+		sockaddr_ll *ll = (sockaddr_ll *)(pkt + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+		if(ll->sll_pkttype != PACKET_OUTGOING) 	// own sends
+		{
+			f[k].data = pkt + h->tp_mac;
+			f[k].len = h->tp_snaplen;
+			f[k].ref = copy ? NULL : &refs[block];
+
+			++k;
+		}
+
+		pkt += h->tp_next_offset;
+
+		if(--left == 0)
+		{
+			block = (block + 1) % blocks;
+			++held;
+			done = true;
+
+			break;
+		}
+	}
+
+	return k;
+}
+
+void PacketDriver::send(const u_int8_t *frame, size_t len)
+{
+	Frame f;
+
+	f.data = frame;
+	f.len = len;
+	f.ref = NULL;
+
+	send(&f, 1);
+}
+
+// Counted frames go out from where they are, the rest through the ring
+// with one kick for the batch. A full ring is kicked once more, frames
+// that still do not fit are dropped.
+void PacketDriver::send(const Frame *f, size_t n)
+{
+	size_t z = 0;
+
+	while(z < n && f[z].ref)
+		++z;
+
+	if(z) transmit(iofd, f, z);
+
+	if(z == n) return;
+
+	bool kicked = false;
+
+	pthread_mutex_lock(&txLock);
+
+	for(size_t i = z; i < n; ++i)
+	{
+		if(f[i].ref)
+		{
+			transmit(iofd, &f[i], 1);
+			continue;
+		}
+
+		if(f[i].len > frameSize - TX_DATA())
+			continue;
+
+		tpacket2_hdr *h = (tpacket2_hdr *)(txRing + txHead * frameSize);
+
+		u_int32_t st = __atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE);
+
+		if(st != TP_STATUS_AVAILABLE && st != TP_STATUS_WRONG_FORMAT)
+		{
+			if(kicked) break;
+
+			::send(txfd, NULL, 0, 0); 		// waits for the ring to drain
+
+			kicked = true;
+
+			st = __atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE);
+
+			if(st != TP_STATUS_AVAILABLE && st != TP_STATUS_WRONG_FORMAT)
+				break;
+		}
+
+		memcpy((u_int8_t *)h + TX_DATA(), f[i].data, f[i].len);
+
+		h->tp_len = f[i].len;
+
+		__atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+		txHead = (txHead + 1) % txFrames;
+	}
+
+	pthread_mutex_unlock(&txLock);
+
+	::send(txfd, NULL, 0, MSG_DONTWAIT);
+}
+
+int PacketDriver::fanout(int group)
+{
+	return join(rxfd, group);
+}
+
+int PacketDriver::nonblock()
+{
+	nowait = true;
+
+	return rxfd;
+}
+
+const char * PacketDriver::type() const
+{
+	return "packet";
+}
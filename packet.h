@@ -0,0 +1,110 @@
+//===================================================================
+// File:        packet.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    AF_PACKET mmap ring backend
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+
+#include "driver.h"
+
+#include <pthread.h>
+
+
+#if RING_BLOCKS <= 0
+# 	define RING_BLOCKS 								64
+#endif
+
+#if RING_BLOCK_SIZE <= 0
+# 	define RING_BLOCK_SIZE 						(1 << 18)
+#endif
+
+#if RING_FRAME_SIZE <= 0
+# 	define RING_FRAME_SIZE 						2048
+#endif
+
+#if RING_TX_FRAMES <= 0
+# 	define RING_TX_FRAMES 						1024
+#endif
+
+#if RING_TIMEOUT <= 0
+# 	define RING_TIMEOUT 							1 			// ms, block retire
+#endif
+
+
+// Frames are received in place from a TPACKET_V3 block ring. Each block
+// is counted, the receiver holds it until the recv() after its last frame
+// and senders while the frame is queued. Blocks go back to the kernel in
+// ring order once nobody holds them. With less than a quarter of the ring
+// left, frames come uncounted so whoever keeps them copies them, and with
+// none left recv() sleeps until a block is back.
+//
+// Counted frames, from any ring-backed port, are sent with sendmmsg()
+// straight from their slot. Others are copied into a TPACKET_V2 frame
+// ring on a second socket, a socket has a single ring version.
+class PacketDriver : public Driver
+{
+private:
+	int rxfd, txfd, iofd;
+private:
+	u_int8_t *rxRing;
+	size_t blocks, blockSize;
+	unsigned *refs; 									// per block
+	size_t block; 										// current
+	size_t left; 											// frames in it
+	u_int8_t *pkt;
+	bool done; 												// drop block - 1
+	size_t tail, held; 								// read, not released
+	bool nowait;
+private:
+	pthread_mutex_t txLock;
+	u_int8_t *txRing;
+	size_t txFrames, frameSize;
+	size_t txHead;
+private:
+	void shut();
+	void release(size_t b);
+	void reclaim();
+	void wait();
+public:
+	PacketDriver(const char *ifname, const DriverConfig &c);
+	~PacketDriver();
+
+	size_t recv(Frame *f, size_t n);
+	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame *f, size_t n);
+
+	int fanout(int group);
+	int nonblock();
+
+	const char *type() const;
+};
+
+
+#endif /* _PACKET_H_ */
@@ -0,0 +1,181 @@
+//===================================================================
+// File:        pool.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Reference-counted frame buffer pool
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "pool.h"
+
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <cstring>
+
+
+#ifndef MAP_HUGETLB
+# 	define MAP_HUGETLB 								0x40000
+#endif
+
+
+FramePool FramePool::pool;
+
+__thread u_int32_t FramePool::cache[POOL_CACHE];
+__thread size_t FramePool::cached = 0;
+
+
+FramePool::FramePool()
+:
+	area(NULL), mapped(0), refs(NULL), bufs(0), bufSize(0), freeList(NULL),
+	nfree(0), huge(false), failed(0), err("")
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+FramePool::~FramePool()
+{
+	if(area) munmap(area, mapped);
+
+	delete [] refs;
+	delete [] freeList;
+}
+
+FramePool & FramePool::instance()
+{
+	return pool;
+}
+
+bool FramePool::fail(const char *what)
+{
+	err = std::string("FramePool(): ") + what + "(): " + strerror(errno);
+
+	return false;
+}
+
+const std::string & FramePool::error() const
+{
+	return err;
+}
+
+// Buffers are cache line multiples, hugepage mappings whole pages.
+bool FramePool::setup(size_t n, size_t size, bool hugepages)
+{
+	size = (size + 63) & ~(size_t)63;
+
+	size_t len = n * size;
+
+	if(hugepages)
+		len = (len + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+
+	void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE
+			| MAP_ANONYMOUS | MAP_POPULATE | (hugepages ? MAP_HUGETLB : 0), -1, 0);
+
+	if(m == MAP_FAILED)
+		return fail(hugepages ? "mmap(MAP_HUGETLB)" : "mmap");
+
+	area = (u_int8_t *)m;
+	mapped = len;
+	bufs = n;
+	bufSize = size;
+	huge = hugepages;
+
+	refs = new unsigned[n];
+	freeList = new u_int32_t[n];
+
+	memset(refs, 0, n * sizeof(unsigned));
+
+	for(nfree = 0; nfree < n; ++nfree)
+		freeList[nfree] = n - nfree - 1;
+
+	return true;
+}
+
+void FramePool::refill()
+{
+	pthread_mutex_lock(&lock);
+
+	while(cached < POOL_CACHE / 2 && nfree)
+		cache[cached++] = freeList[--nfree];
+
+	pthread_mutex_unlock(&lock);
+}
+
+void FramePool::spill()
+{
+	pthread_mutex_lock(&lock);
+
+	while(cached > POOL_CACHE / 2)
+		freeList[nfree++] = cache[--cached];
+
+	pthread_mutex_unlock(&lock);
+}
+
+u_int8_t * FramePool::alloc(unsigned *&ref)
+{
+	if(!cached) refill();
+
+	if(!cached)
+	{
+		__atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	u_int32_t i = cache[--cached];
+
+	ref = &refs[i];
+	__atomic_store_n(ref, 1, __ATOMIC_RELAXED);
+
+	return area + i * bufSize;
+}
+
+void FramePool::put(unsigned *ref)
+{
+	if(cached == POOL_CACHE) spill();
+
+	cache[cached++] = ref - refs;
+}
+
+size_t FramePool::bufLen() const
+{
+	return bufSize;
+}
+
+// Buffers in thread caches count as used.
+std::ostream & operator <<(std::ostream &os, const FramePool &p)
+{
+	pthread_mutex_lock(&p.lock);
+
+	size_t free = p.nfree;
+
+	pthread_mutex_unlock(&p.lock);
+
+	os << "Buffers\t\tSize\tUsed\t\tFailed\t\tPages" << std::endl
+		<< p.bufs << "\t\t" << p.bufSize << "\t" << p.bufs - free << "\t\t"
+		<< __atomic_load_n(&p.failed, __ATOMIC_RELAXED) << "\t\t"
+		<< (p.huge ? "2M" : p.bufs ? "4k" : "-");
+
+	return os;
+}
@@ -0,0 +1,107 @@
+//===================================================================
+// File:        pool.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Reference-counted frame buffer pool
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <string>
+#include <iostream>
+
+
+#if POOL_BUFS <= 0
+# 	define POOL_BUFS 									8192
+#endif
+
+#if POOL_BUF_SIZE <= 0
+# 	define POOL_BUF_SIZE 							2048 	// longer frames are not pooled
+#endif
+
+#if POOL_CACHE <= 0
+# 	define POOL_CACHE 								64 		// buffers per thread
+#endif
+
+#define HUGE_PAGE 										(2 << 20)
+
+
+// Fixed-size frame buffers with a reference count each, for frames that
+// must outlive the recv() returning them. Every thread keeps a cache and
+// trades half of it with the shared free list at a time, the last
+// Frame::drop() of a pooled frame puts its buffer back. The buffers may
+// live on 2 MB hugepages.
+class FramePool
+{
+private:
+	static FramePool pool;
+	static __thread u_int32_t cache[POOL_CACHE];
+	static __thread size_t cached;
+private:
+	mutable pthread_mutex_t lock;
+	u_int8_t *area;
+	size_t mapped;
+	unsigned *refs;
+	size_t bufs, bufSize;
+	u_int32_t *freeList;
+	size_t nfree;
+	bool huge;
+	unsigned long failed;
+	std::string err;
+private:
+	FramePool();
+	bool fail(const char *what);
+	void refill();
+	void spill();
+public:
+	static FramePool & instance();
+public:
+	~FramePool();
+public: 	// init //
+	bool setup(size_t n, size_t size, bool hugepages);
+	const std::string & error() const;
+public: 	// concurrent //
+	u_int8_t * alloc(unsigned *&ref); 	// count 1, NULL if exhausted
+	void put(unsigned *ref);
+	bool owns(const unsigned *ref) const;
+	size_t bufLen() const; 						// 0 if not set up
+
+	friend std::ostream & operator <<(std::ostream &os, const FramePool &p);
+};
+
+
+inline bool FramePool::owns(const unsigned *ref) const
+{
+	return ref >= refs && ref < refs + bufs;
+}
+
+
+#endif /* _POOL_H_ */
@@ -29,6 +29,8 @@
 
 
 #include "port.h"
+#include "epoch.h"
+#include "affinity.h"
 
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
@@ -36,6 +38,7 @@
 #include <netinet/in.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <stdio.h>
 #include <libnet.h>
@@ -55,6 +58,36 @@ Broadcast Broadcast::brc;
 
 MulticastStack MulticastStack::mst;
 
+inline static Frame FRAME(const u_int8_t *data, size_t len)
+{
+	Frame f;
+
+	f.data = data;
+	f.len = len;
+	f.ref = NULL;
+
+	return f;
+}
+
+// Moves a frame into a pool buffer, false if it stays.
+inline static bool POOL(Frame &f)
+{
+	FramePool &fp = FramePool::instance();
+
+	u_int8_t *b;
+	unsigned *ref;
+
+	if(f.len > fp.bufLen() || (b = fp.alloc(ref)) == NULL)
+		return false;
+
+	memcpy(b, f.data, f.len);
+
+	f.data = b;
+	f.ref = ref;
+
+	return true;
+}
+
 inline static bool VALID_DEVICE(const char *name, unsigned flags)
 {
 	if(flags == PCAP_IF_LOOPBACK) return false;
@@ -113,8 +146,13 @@ int Port::assignId()
 
 Port::Port()
 :
-	id(freeId++)
+	id(freeId++), down(false), bit(-1)
+{
+}
+
+void Port::send(const Frame &f, const Port *in)
 {
+	send(f.data, f.len, in);
 }
 
 bool Port::same(const Port *p)
@@ -125,40 +163,113 @@ bool Port::same(const Port *p)
 	return id == p->id;
 }
 
+int Port::slot() const
+{
+	return bit;
+}
 
-const u_int8_t * Interface::receive()
+void Port::setDown(bool d)
 {
-	const u_int8_t *data = pcap_next(fp, &hdr);
+	__atomic_store_n(&down, d, __ATOMIC_RELEASE);
+}
 
-	assert(hdr.caplen == hdr.len); 		// avoid data loss
+bool Port::isDown() const
+{
+	return __atomic_load_n(&down, __ATOMIC_ACQUIRE);
+}
 
-	++recvF;
-	recvB += hdr.len;
 
-	return data;
+TxQueue::TxQueue(size_t depth, const Interface *in, size_t w)
+:
+	ring(depth), drops(0), peak(0), from(in), worker(w)
+{
 }
 
-Interface::Interface(const char *nm)
+
+// The first driver starts the fanout group, the other receivers join it.
+// Their drivers never send. Each is created on the core its receiver is
+// to run on.
+Interface::Interface(const char *nm, size_t index, size_t producer,
+		const DriverConfig &c)
 :
-	recvB(0), sentB(0), recvF(0), sentF(0),
-	opened(false), ifnm(nm)
+	sentB(0), sentF(0), drv(NULL), ifnm(nm), idx(index), prod(producer),
+	burst(0), txWait(false), txSleep(false)
 {
-	char perr[PCAP_ERRBUF_SIZE];
-
 	pthread_mutex_init(&mutexSent, NULL);
+	pthread_mutex_init(&txMutex, NULL);
+	pthread_cond_init(&txCond, NULL);
+
+	if(index >= PORT_MAX)
+		throw std::string("Interface(): ") + nm + ": more than PORT_MAX ports";
+
+	bit = index;
+
+	size_t n = c.get("workers", 1);
+
+	if(n == 0 || n > RX_WORKERS_MAX)
+		throw std::string("Interface(): ") + nm + ": bad number of workers";
+
+	DriverConfig dc = c;
+
+	dc.opt.erase("workers");
+
+	Affinity &aff = Affinity::instance();
+
+	try
+	{
+		int group = -1;
+
+		for(size_t i = 0; i < n; ++i)
+		{
+			Receiver *r = new Receiver;
+
+			r->drv = NULL;
+			r->rx = NULL;
+			r->nrx = 0;
+			r->bytes = r->frames = r->calls = 0;
+			r->busy = r->device = false;
 
-	if((fp = pcap_open_live(nm, SNAPLEN, 1, 0, perr)) == NULL)
-		throw std::string("Interface(): pcap_open_live(): ") + perr;
+			rxs.push_back(r);
+
+			aff.enter(aff.coreOf(producer + i));
+
+			r->drv = Driver::create(nm, dc);
+
+			if(n > 1)
+				group = r->drv->fanout(group);
+
+			aff.leave();
+		}
+	}
+	catch(const std::string &str)
+	{
+		aff.leave();
+
+		for(size_t i = 0; i < rxs.size(); ++i)
+		{
+			delete rxs[i]->drv;
+			delete rxs[i];
+		}
+
+		throw std::string("Interface(): ") + nm + ": " + str;
+	}
 
-	//if(pcap_setdirection(fp, PCAP_D_IN) == -1)
-		//throw std::string("Interface(): pcap_set_direction(): ") + pcap_geterr(fp);
+	drv = rxs[0]->drv;
 
-	opened = true;
+	setBurst(RX_BURST);
 }
 
 Interface::~Interface()
 {
-	if(opened) pcap_close(fp);
+	for(size_t i = 0; i < txq.size(); ++i)
+		delete txq[i];
+
+	for(size_t i = 0; i < rxs.size(); ++i)
+	{
+		delete rxs[i]->drv;
+		delete [] rxs[i]->rx;
+		delete rxs[i];
+	}
 }
 
 void Interface::send(const u_int8_t *frame, size_t len, const Port *in)
@@ -173,25 +284,277 @@ void Interface::send(const u_int8_t *frame, size_t len, const Port *in)
 
 void Interface::send(const u_int8_t *frame, size_t len)
 {
+	send(FRAME(frame, len));
+}
+
+void Interface::send(const Frame &f, const Port *in)
+{
+	assert(in != NULL);
+
+	if(same(in))
+		return;
+
+	send(f);
+}
+
+void Interface::send(const Frame &f)
+{
+	if(isDown())
+		return;
+
+	TxBatch *b = TxBatch::current();
+
+	if(b != NULL)
+	{
+		b->add(this, f);
+		return;
+	}
+
+	send(&f, 1);
+}
+
+void Interface::send(const Frame *f, size_t n)
+{
+	if(isDown())
+		return;
+
+	size_t len = 0;
+
+	for(size_t i = 0; i < n; ++i)
+		len += f[i].len;
+
 	pthread_mutex_lock(&mutexSent);
 
-	++sentF;
+	sentF += n;
 	sentB += len;
 
 	pthread_mutex_unlock(&mutexSent);
 
-	pcap_sendpacket(fp, frame, len); 	// auto synchronized
+	drv->send(f, n);
+}
+
+// Blocks until at least one frame is there, returns up to burst frames
+// valid until the next call. Frames enqueue() moved into the pool
+// meanwhile are dropped by the next call.
+size_t Interface::recv(size_t worker, const Frame **frames)
+{
+	FramePool &fp = FramePool::instance();
+
+	Receiver &r = *rxs[worker];
+
+	for(size_t i = 0; i < r.nrx; ++i)
+		if(fp.owns(r.rx[i].ref))
+			r.rx[i].drop();
+
+	r.nrx = 0;
+
+	size_t n = r.drv->recv(r.rx, burst);
+
+	if(n == 0) return 0;
+
+	r.nrx = n;
+
+	++r.calls;
+	r.frames += n;
+
+	for(size_t i = 0; i < n; ++i)
+		r.bytes += r.rx[i].len;
+
+	*frames = r.rx;
+
+	return n;
+}
+
+// The burst entry f is, if it is one of the last frames worker received.
+Frame * Interface::received(size_t worker, const Frame &f) const
+{
+	const Receiver &r = *rxs[worker];
+
+	if(&f < r.rx || &f >= r.rx + r.nrx)
+		return NULL;
+
+	return r.rx + (&f - r.rx);
+}
+
+int Interface::nonblock(size_t worker)
+{
+	return rxs[worker]->drv->nonblock();
+}
+
+// The receiver thread polls instead of waiting, the kernel polls the
+// device as well where the driver can.
+void Interface::busyPoll(size_t worker, unsigned usec)
+{
+	Receiver &r = *rxs[worker];
+
+	r.drv->nonblock();
+
+	r.busy = true;
+	r.device = usec && r.drv->busyPoll(usec);
+}
+
+bool Interface::polling(size_t worker) const
+{
+	return rxs[worker]->busy;
+}
+
+PollStats & Interface::pollStats(size_t worker)
+{
+	return rxs[worker]->poll;
+}
+
+bool Interface::setBurst(size_t n)
+{
+	if(n == 0 || n > RX_BURST_MAX)
+		return false;
+
+	for(size_t i = 0; i < rxs.size(); ++i)
+	{
+		delete [] rxs[i]->rx;
+
+		rxs[i]->rx = new Frame[n];
+	}
+
+	burst = n;
+
+	return true;
+}
+
+// One queue for every receiver of the other ports.
+void Interface::setQueues(const std::vector<Interface *> &ports, size_t depth,
+		bool wait)
+{
+	for(size_t i = 0; i < txq.size(); ++i)
+		delete txq[i];
+
+	txq.clear();
+	txWait = wait;
+
+	if(depth == 0 || ports.empty())
+		return;
+
+	txq.assign(ports.back()->producer(ports.back()->workers()), NULL);
+
+	for(size_t i = 0; i < ports.size(); ++i)
+		for(size_t w = 0; ports[i] != this && w < ports[i]->workers(); ++w)
+			txq[ports[i]->producer(w)] = new TxQueue(depth, ports[i], w);
+}
+
+bool Interface::queued() const
+{
+	return !txq.empty();
+}
+
+// A frame is held or copied only once there is room for it, frames
+// longer than a pool buffer or finding the pool empty are dropped. A
+// queue already backed up copies ring frames too, a slow egress must not
+// keep the ingress ring from being reused. A copy of a received frame
+// replaces it in its receiver's burst, the other egress ports then share
+// it and the next recv() drops it. A copy of any other frame belongs to
+// the queue alone.
+void Interface::enqueue(size_t in, const Frame &f)
+{
+	TxQueue &q = *txq[in];
+
+	if(!txWait && q.ring.size() == q.ring.capacity())
+	{
+		++q.drops;
+		return;
+	}
+
+	Frame it = f;
+
+	if(FramePool::instance().owns(f.ref) || (f.ref && q.ring.size() < TX_BATCH))
+		it.hold();
+	else if(!POOL(it)) 								// counted once, for the queue
+	{
+		++q.drops;
+		return;
+	}
+	else if(Frame *s = q.from->received(q.worker, f))
+	{
+		*s = it; 												// the burst keeps that count
+		it.hold();
+	}
+
+	while(!q.ring.push(it)) 					// waiting
+	{
+		wake();
+		sched_yield();
+	}
+
+	size_t n = q.ring.size();
+
+	if(n > q.peak) q.peak = n;
+}
+
+// Producer side of the doorbell, after its frames are pushed.
+void Interface::wake()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(!__atomic_load_n(&txSleep, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&txMutex);
+
+	__atomic_store_n(&txSleep, false, __ATOMIC_RELAXED);
+	pthread_cond_signal(&txCond);
+
+	pthread_mutex_unlock(&txMutex);
 }
 
-const u_int8_t * Interface::recv(size_t *len)
+bool Interface::pending() const
 {
-	const u_int8_t *data = receive();
+	for(size_t i = 0; i < txq.size(); ++i)
+		if(txq[i] && txq[i]->ring.size())
+			return true;
+
+	return false;
+}
+
+// Takes up to TX_BATCH frames from each receiver in turn, so one flooding
+// port cannot starve the others.
+bool Interface::drain()
+{
+	Frame f[TX_BATCH];
+	bool any = false;
+
+	for(size_t i = 0; i < txq.size(); ++i)
+	{
+		if(!txq[i]) continue;
+
+		size_t n = txq[i]->ring.pop(f, TX_BATCH);
 
-	if(data == NULL) return NULL;
+		if(n == 0) continue;
 
-	*len = hdr.len;
+		send(f, n);
 
-	return data;
+		for(size_t k = 0; k < n; ++k)
+			f[k].drop();
+
+		any = true;
+	}
+
+	return any;
+}
+
+// The flag is raised before the last look at the queues, a producer
+// pushing meanwhile sees it in wake().
+void Interface::idle()
+{
+	__atomic_store_n(&txSleep, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&txMutex);
+
+	if(pending())
+		__atomic_store_n(&txSleep, false, __ATOMIC_RELAXED);
+
+	while(__atomic_load_n(&txSleep, __ATOMIC_RELAXED))
+		pthread_cond_wait(&txCond, &txMutex);
+
+	pthread_mutex_unlock(&txMutex);
 }
 
 const char * Interface::name() const
@@ -199,6 +562,31 @@ const char * Interface::name() const
 	return ifnm.c_str();
 }
 
+const char * Interface::driver() const
+{
+	return drv->type();
+}
+
+Driver * Interface::backend() const
+{
+	return drv;
+}
+
+size_t Interface::index() const
+{
+	return idx;
+}
+
+size_t Interface::workers() const
+{
+	return rxs.size();
+}
+
+size_t Interface::producer(size_t worker) const
+{
+	return prod + worker;
+}
+
 unsigned long Interface::statSentBytes() const
 {
 	return sentB;
@@ -211,12 +599,156 @@ unsigned long Interface::statSentFrames() const
 
 unsigned long Interface::statRecvBytes() const
 {
-	return recvB;
+	unsigned long n = 0;
+
+	for(size_t i = 0; i < rxs.size(); ++i)
+		n += rxs[i]->bytes;
+
+	return n;
 }
 
 unsigned long Interface::statRecvFrames() const
 {
-	return recvF;
+	unsigned long n = 0;
+
+	for(size_t i = 0; i < rxs.size(); ++i)
+		n += rxs[i]->frames;
+
+	return n;
+}
+
+unsigned long Interface::statRecvCalls() const
+{
+	unsigned long n = 0;
+
+	for(size_t i = 0; i < rxs.size(); ++i)
+		n += rxs[i]->calls;
+
+	return n;
+}
+
+void Interface::showQueues(std::ostream &os) const
+{
+	for(size_t i = 0; i < txq.size(); ++i)
+		if(txq[i])
+		{
+			os << std::endl << txq[i]->from->name();
+
+			if(txq[i]->from->workers() > 1)
+				os << ":" << txq[i]->worker;
+
+			os << "\t\t" << name() << "\t\t"
+				<< txq[i]->ring.capacity() << "\t" << txq[i]->ring.size() << "\t"
+				<< txq[i]->peak << "\t" << txq[i]->drops;
+		}
+}
+
+
+// Time shares of the accounted time, the empty share of the polls.
+void Interface::showPolls(std::ostream &os) const
+{
+	for(size_t i = 0; i < rxs.size(); ++i)
+	{
+		const Receiver &r = *rxs[i];
+
+		if(!r.busy) continue;
+
+		const PollStats &s = r.poll;
+
+		double t = s.work + s.spin + s.yield + s.sleep;
+
+		if(t == 0) t = 1;
+
+		os << std::endl << name();
+
+		if(rxs.size() > 1)
+			os << ":" << i;
+
+		os << "\t\t" << s.polls << "\t\t"
+			<< 100.0 * s.empty / (s.polls ? s.polls : 1) << "\t"
+			<< 100.0 * s.work / t << "\t" << 100.0 * s.spin / t << "\t"
+			<< 100.0 * s.yield / t << "\t" << 100.0 * s.sleep / t << "\t"
+			<< (r.device ? "yes" : "no");
+	}
+}
+
+
+__thread TxBatch * TxBatch::cur = NULL;
+
+TxBatch * TxBatch::current()
+{
+	return cur;
+}
+
+TxBatch::TxBatch(size_t ports, size_t producer)
+:
+	queue(ports), in(producer)
+{
+	for(size_t i = 0; i < ports; ++i)
+		queue[i].n = 0;
+}
+
+void TxBatch::attach()
+{
+	cur = this;
+}
+
+void TxBatch::from(size_t producer)
+{
+	in = producer;
+}
+
+// A queued frame holds its block, a flood holds it once per egress
+// instead of being copied.
+void TxBatch::add(Interface *i, const Frame &f)
+{
+	Queue &q = queue[i->index()];
+
+	if(i->queued())
+	{
+		if(q.n++ == 0)
+			dirty.push_back(i);
+
+		i->enqueue(in, f);
+		return;
+	}
+
+	if(q.n == TX_BATCH) 							// stays dirty
+		send(i, q);
+	else if(q.n == 0)
+		dirty.push_back(i);
+
+	f.hold();
+
+	q.frame[q.n++] = f;
+}
+
+void TxBatch::send(Interface *i, Queue &q)
+{
+	i->send(q.frame, q.n);
+
+	for(size_t k = 0; k < q.n; ++k)
+		q.frame[k].drop();
+
+	q.n = 0;
+}
+
+void TxBatch::flush()
+{
+	for(size_t i = 0; i < dirty.size(); ++i)
+	{
+		Queue &q = queue[dirty[i]->index()];
+
+		if(dirty[i]->queued())
+		{
+			dirty[i]->wake();
+			q.n = 0;
+		}
+		else if(q.n)
+			send(dirty[i], q);
+	}
+
+	dirty.clear();
 }
 
 
@@ -231,18 +763,29 @@ Broadcast & Broadcast::instance()
 
 void Broadcast::send(const u_int8_t *frame, size_t len, const Port *in)
 {
+	assert(in != NULL);
+
+	send(FRAME(frame, len), in);
+}
+
+void Broadcast::send(const Frame &f, const Port *in)
+{
+	assert(in != NULL);
+
 	InterfaceStack &ifs = InterfaceStack::instance();
 
-	for(size_t i = 0; i < ifs.size(); ++i)
-		ifs[i]->send(frame, len, in);
+	PortMask m = ifs.mask();
+
+	m.clear(in->slot());
+
+	ifs.send(m, f);
 }
 
 void Broadcast::send(const u_int8_t *frame, size_t len)
 {
 	InterfaceStack &ifs = InterfaceStack::instance();
 
-	for(size_t i = 0; i < ifs.size(); ++i)
-		ifs[i]->send(frame, len);
+	ifs.send(ifs.mask(), FRAME(frame, len));
 }
 
 const char * Broadcast::name() const
@@ -259,6 +802,12 @@ InterfaceStack & InterfaceStack::instance()
 InterfaceStack::InterfaceStack()
 :
 	err("")
+{
+}
+
+// Opens every usable device, with the backend configured for it or the
+// default one.
+bool InterfaceStack::open(const std::map<std::string, DriverConfig> &cfg)
 {
 	char perr[PCAP_ERRBUF_SIZE];
 	pcap_if_t *alldevs;
@@ -267,13 +816,27 @@ InterfaceStack::InterfaceStack()
 	{
 		err = "InterfaceStack(): pcap_findalldevs(): ";
 		err += perr;
+
+		return false;
 	}
 
+	std::set<std::string> found;
+
 	try
 	{
 		for(pcap_if_t *d = alldevs; d != NULL; d = d->next)
 			if(VALID_DEVICE(d->name, d->flags))
-					table.push_back(new Interface(d->name));
+			{
+				std::map<std::string, DriverConfig>::const_iterator c =
+					cfg.find(d->name);
+
+				table.push_back(new Interface(d->name, table.size(), producers(),
+							c == cfg.end() ? DriverConfig() : c->second));
+
+				all.set(table.size() - 1);
+
+				found.insert(d->name);
+			}
 	}
 	catch(const std::string &str)
 	{
@@ -282,6 +845,14 @@ InterfaceStack::InterfaceStack()
 	}
 
 	pcap_freealldevs(alldevs);
+
+	std::map<std::string, DriverConfig>::const_iterator it = cfg.begin();
+
+	for(; err.empty() && it != cfg.end(); ++it)
+		if(!found.count(it->first))
+			err = "InterfaceStack(): no interface `" + it->first + "'";
+
+	return err.empty();
 }
 
 InterfaceStack::~InterfaceStack()
@@ -302,6 +873,11 @@ size_t InterfaceStack::size() const
 	return table.size();
 }
 
+size_t InterfaceStack::producers() const
+{
+	return table.empty() ? 0 : table.back()->producer(table.back()->workers());
+}
+
 Interface * InterfaceStack::operator [](size_t i) const
 {
 	assert(i <= table.size());
@@ -309,31 +885,83 @@ Interface * InterfaceStack::operator [](size_t i) const
 	return table[i];
 }
 
+Interface * InterfaceStack::find(const char *name) const
+{
+	std::vector<Interface *>::const_iterator it = table.begin();
+
+	for(; it != table.end(); ++it)
+		if(!strcmp((*it)->name(), name))
+			return *it;
+
+	return NULL;
+}
+
+const PortMask & InterfaceStack::mask() const
+{
+	return all;
+}
+
+void InterfaceStack::send(const PortMask &m, const Frame &f) const
+{
+	for(int i = m.next(-1); i != -1; i = m.next(i))
+		table[i]->send(f);
+}
+
 std::ostream & operator <<(std::ostream &os, const InterfaceStack &s)
 {
-	os << "Iface\t\tSent-B\t\tSent-frm\tRecv-B\t\tRecv-frm";
+	os << "Iface\t\tDriver\tRx\tSent-B\t\tSent-frm\tRecv-B\t\tRecv-frm\tFrm/recv";
 
 	std::vector<Interface *>::const_iterator it = s.table.begin();
 
 	for(; it != s.table.end(); ++it)
-		os << std::endl << (*it)->name() << "\t\t" << (*it)->statSentBytes()
+	{
+		unsigned long c = (*it)->statRecvCalls();
+
+		os << std::endl << (*it)->name() << "\t\t" << (*it)->driver() << "\t"
+			<< (*it)->workers() << "\t" << (*it)->statSentBytes()
 			<< "\t\t" << (*it)->statSentFrames() << "\t\t" << (*it)->statRecvBytes()
-			<< "\t\t" << (*it)->statRecvFrames();
+			<< "\t\t" << (*it)->statRecvFrames() << "\t\t"
+			<< (c ? (double)(*it)->statRecvFrames() / c : 0.0);
+	}
 
 	return os;
 }
 
+void InterfaceStack::setQueues(size_t depth, bool wait)
+{
+	for(size_t i = 0; i < table.size(); ++i)
+		table[i]->setQueues(table, depth, wait);
+}
+
+void InterfaceStack::showPolls(std::ostream &os) const
+{
+	os.precision(3);
+
+	os << "Receiver\tPolls\t\tEmpty%\tWork%\tSpin%\tYield%\tSleep%\tDevice";
+
+	for(size_t i = 0; i < table.size(); ++i)
+		table[i]->showPolls(os);
+}
 
+void InterfaceStack::showQueues(std::ostream &os) const
+{
+	os << "Ingress\t\tEgress\t\tDepth\tQueued\tPeak\tDrops";
+
+	for(size_t i = 0; i < table.size(); ++i)
+		table[i]->showQueues(os);
+}
+
+
+// Any receiver may see a query, the querier is read without a lock.
 void Multicast::setQuerier(Interface *querier)
 {
-	qrr = querier;
+	__atomic_store_n(&qrr, querier, __ATOMIC_RELEASE);
 }
 
 Multicast::Multicast(u_int32_t group)
 :
 	grp(group)
 {
-	pthread_rwlock_init(&lock, NULL);
 }
 
 Multicast::~Multicast()
@@ -342,54 +970,46 @@ Multicast::~Multicast()
 
 void Multicast::add(Interface *p)
 {
-	pthread_rwlock_wrlock(&lock);
-
-	table.insert(p);
-
-	pthread_rwlock_unlock(&lock);
+	table.add(p->slot());
 }
 
 void Multicast::remove(Interface *p)
 {
-	pthread_rwlock_wrlock(&lock);
-
-	table.erase(p);
-
-	pthread_rwlock_unlock(&lock);
-
-	MulticastStack::instance().cleanup();
+	table.remove(p->slot());
 }
 
 void Multicast::send(const u_int8_t *frame, size_t len, const Port *in)
 {
-	assert(qrr != NULL);
+	assert(in != NULL);
+
+	send(FRAME(frame, len), in);
+}
 
-	pthread_rwlock_rdlock(&lock);
+void Multicast::send(const Frame &f, const Port *in)
+{
+	Interface *q = __atomic_load_n(&qrr, __ATOMIC_ACQUIRE);
 
-	std::set<Interface *>::const_iterator it = table.begin();
+	assert(q != NULL && in != NULL);
 
-	qrr->send(frame, len, in);
+	PortMask m = table.load();
 
-	for(; it != table.end(); ++it)
-		(*it)->send(frame, len, in);
+	m.set(q->slot());
+	m.clear(in->slot());
 
-	pthread_rwlock_unlock(&lock);
+	InterfaceStack::instance().send(m, f);
 }
 
 void Multicast::send(const u_int8_t *frame, size_t len)
 {
-	assert(qrr != NULL);
+	Interface *q = __atomic_load_n(&qrr, __ATOMIC_ACQUIRE);
 
-	pthread_rwlock_rdlock(&lock);
+	assert(q != NULL);
 
-	std::set<Interface *>::const_iterator it = table.begin();
+	PortMask m = table.load();
 
-	qrr->send(frame, len);
-
-	for(; it != table.end(); ++it)
-		(*it)->send(frame, len);
+	m.set(q->slot());
 
-	pthread_rwlock_unlock(&lock);
+	InterfaceStack::instance().send(m, FRAME(frame, len));
 }
 
 const char * Multicast::name() const
@@ -397,35 +1017,59 @@ const char * Multicast::name() const
 	return "<mcast>";
 }
 
+u_int32_t Multicast::group() const
+{
+	return grp;
+}
+
 bool Multicast::empty() const
 {
-	return table.empty();
+	return table.load().empty();
+}
+
+void Multicast::members(std::vector<Interface *> &v) const
+{
+	InterfaceStack &ifs = InterfaceStack::instance();
+
+	PortMask m = table.load();
+
+	for(int i = m.next(-1); i != -1; i = m.next(i))
+		v.push_back(ifs[i]);
 }
 
 std::ostream & operator <<(std::ostream &os, const Multicast &m)
 {
 	assert(m.qrr != NULL);
 
-	pthread_rwlock_rdlock(&m.lock);
-
 	os << libnet_addr2name4(m.grp, LIBNET_DONT_RESOLVE) << "\t*" << m.qrr->name();
 
-	std::set<Interface *>::const_iterator it = m.table.begin();
+	std::vector<Interface *> v;
 
-	for(; it != m.table.end(); ++it)
-		os << ", " << (*it)->name();
+	m.members(v);
 
-	pthread_rwlock_unlock(&m.lock);
+	for(size_t i = 0; i < v.size(); ++i)
+		os << ", " << v[i]->name();
 
 	return os;
 }
 
 
+inline static Multicast * TOMB()
+{
+	return (Multicast *)1;
+}
+
+inline static size_t GROUP_HOME(u_int32_t group, size_t mask)
+{
+	return ((group * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+
 MulticastStack::MulticastStack()
 :
-	qr(NULL)
+	index(newIndex(MCAST_TABLE_SIZE)), used(0), dead(0), qr(NULL)
 {
-	pthread_rwlock_init(&lock, NULL);
+	pthread_mutex_init(&lock, NULL);
 }
 
 MulticastStack & MulticastStack::instance()
@@ -435,18 +1079,42 @@ MulticastStack & MulticastStack::instance()
 
 MulticastStack::~MulticastStack()
 {
-	mclookup_t::const_iterator it = table.begin();
+	for(size_t i = 0; i <= index->mask; ++i)
+		if(index->slot[i] && index->slot[i] != TOMB())
+			delete index->slot[i];
 
-	for(; it != table.end(); ++it)
-		delete it->second;
+	freeIndex(index);
+}
+
+MulticastStack::Index * MulticastStack::newIndex(size_t slots)
+{
+	Index *ix = new Index;
+
+	ix->slot = new Multicast *[slots];
+	ix->mask = slots - 1;
+
+	memset(ix->slot, 0, slots * sizeof(Multicast *));
+
+	return ix;
+}
+
+void MulticastStack::freeIndex(void *ix)
+{
+	Index *i = (Index *)ix;
+
+	delete [] i->slot;
+	delete i;
+}
+
+void MulticastStack::freeGroup(void *mc)
+{
+	delete (Multicast *)mc;
 }
 
 void MulticastStack::sendQuery(Interface *querier, const u_int8_t *frame,
 		size_t len)
 {
-	qr = querier;
-
-	Multicast::setQuerier(qr);
+	setQuerier(querier);
 
 	Broadcast::instance().send(frame, len, querier);
 }
@@ -454,77 +1122,216 @@ void MulticastStack::sendQuery(Interface *querier, const u_int8_t *frame,
 void MulticastStack::sendResponse(const u_int8_t *frame, size_t len,
 		const Port *in)
 {
-	if(qr == NULL) return;
+	Interface *q = getQuerier();
 
-	qr->send(frame, len, in);
+	if(q == NULL) return;
+
+	q->send(frame, len, in);
 }
 
 Multicast * MulticastStack::find(u_int32_t group) const
 {
-	pthread_rwlock_rdlock(&lock);
+	const Index *ix = __atomic_load_n(&index, __ATOMIC_ACQUIRE);
 
-	mclookup_t::const_iterator it = table.find(group);
+	for(size_t i = GROUP_HOME(group, ix->mask);; i = (i + 1) & ix->mask)
+	{
+		Multicast *mc = __atomic_load_n(&ix->slot[i], __ATOMIC_ACQUIRE);
 
-	if(it == table.end())
+		if(mc == NULL)
+			return NULL;
+
+		if(mc != TOMB() && mc->group() == group)
+			return mc;
+	}
+}
+
+// Writer lock held. The first tombstone on the way is returned for a
+// missing group, so it is reused.
+size_t MulticastStack::lookup(u_int32_t group) const
+{
+	size_t free = index->mask + 1;
+
+	for(size_t i = GROUP_HOME(group, index->mask);; i = (i + 1) & index->mask)
 	{
-		pthread_rwlock_unlock(&lock);
-		return NULL;
+		Multicast *mc = index->slot[i];
+
+		if(mc == NULL)
+			return free <= index->mask ? free : i;
+
+		if(mc == TOMB())
+		{
+			if(free > index->mask) free = i;
+		}
+		else if(mc->group() == group)
+			return i;
+	}
+}
+
+// Writer lock held. Readers go on with the old table until the new one
+// is published, the old one is freed through the Epoch.
+void MulticastStack::rebuild(size_t slots)
+{
+	Index *ix = newIndex(slots);
+
+	for(size_t i = 0; i <= index->mask; ++i)
+	{
+		Multicast *mc = index->slot[i];
+
+		if(mc == NULL || mc == TOMB()) continue;
+
+		size_t k = GROUP_HOME(mc->group(), ix->mask);
+
+		while(ix->slot[k])
+			k = (k + 1) & ix->mask;
+
+		ix->slot[k] = mc;
+	}
+
+	Index *o = index;
+
+	__atomic_store_n(&index, ix, __ATOMIC_RELEASE);
+
+	dead = 0;
+
+	Epoch::instance().retire(freeIndex, o);
+}
+
+// Load factor is kept at 1/2 for groups and 3/4 with tombstones.
+bool MulticastStack::join(u_int32_t group, Interface *p)
+{
+	Interface *q = getQuerier();
+
+	if(q == NULL) return false;
+
+	pthread_mutex_lock(&lock);
+
+	size_t i = lookup(group);
+
+	Multicast *mc = index->slot[i];
+
+	if(mc == NULL || mc == TOMB())
+	{
+		if(mc == TOMB()) --dead;
+
+		mc = new Multicast(group);
+
+		mc->setQuerier(q);
+		mc->add(p);
+
+		__atomic_store_n(&index->slot[i], mc, __ATOMIC_RELEASE);
+
+		++used;
+
+		if(4 * (used + dead) > 3 * (index->mask + 1))
+		{
+			size_t slots = MCAST_TABLE_SIZE;
+
+			while(slots < 2 * used)
+				slots <<= 1;
+
+			rebuild(slots);
+		}
+	}
+	else
+	{
+		mc->setQuerier(q);
+		mc->add(p);
 	}
 
-	pthread_rwlock_unlock(&lock);
-	return it->second;
+	pthread_mutex_unlock(&lock);
+
+	return true;
 }
 
-Multicast * MulticastStack::operator [](u_int32_t group)
+// An emptied group leaves the lookup at once, so its traffic is flooded
+// again, the object is freed once no reader can hold it.
+void MulticastStack::leave(u_int32_t group, Interface *p)
 {
-	if(qr == NULL) return NULL;
+	pthread_mutex_lock(&lock);
+
+	size_t i = lookup(group);
+
+	Multicast *mc = index->slot[i];
 
-	pthread_rwlock_wrlock(&lock);
+	if(mc != NULL && mc != TOMB())
+	{
+		mc->remove(p);
 
-	Multicast *&mc = table[group];
+		if(mc->empty())
+		{
+			__atomic_store_n(&index->slot[i], TOMB(), __ATOMIC_RELEASE);
 
-	if(mc == NULL) mc = new Multicast(group);
+			--used;
+			++dead;
 
-	mc->setQuerier(qr);
+			Epoch::instance().retire(freeGroup, mc);
 
-	pthread_rwlock_unlock(&lock);
+			if(4 * dead > index->mask + 1)
+				rebuild(index->mask + 1);
+		}
+	}
 
-	return mc;
+	pthread_mutex_unlock(&lock);
 }
 
 Interface * MulticastStack::getQuerier() const
 {
-	return qr;
+	return __atomic_load_n(&qr, __ATOMIC_ACQUIRE);
 }
 
-void MulticastStack::cleanup()
+void MulticastStack::setQuerier(Interface *querier)
 {
-	pthread_rwlock_wrlock(&lock);
+	__atomic_store_n(&qr, querier, __ATOMIC_RELEASE);
 
-	mclookup_t::iterator it = table.begin();
+	Multicast::setQuerier(querier);
+}
 
-	for(; it != table.end(); ++it)
-		if(it->second->empty())
+void MulticastStack::records(std::vector<MulticastRecord> &r) const
+{
+	pthread_mutex_lock(&lock);
+
+	for(size_t k = 0; k <= index->mask; ++k)
+	{
+		Multicast *mc = index->slot[k];
+
+		if(mc == NULL || mc == TOMB()) continue;
+
+		std::vector<Interface *> v;
+
+		mc->members(v);
+
+		for(size_t i = 0; i < v.size(); ++i)
 		{
-			table.erase(it);
-			delete it->second;
+			MulticastRecord rec;
+
+			rec.group = mc->group();
+			rec.port = v[i];
+
+			r.push_back(rec);
 		}
+	}
 
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
 }
 
 std::ostream & operator <<(std::ostream &os, const MulticastStack &s)
 {
 	os << "GroupAddr\tIfaces";
 
-	pthread_rwlock_rdlock(&s.lock);
+	pthread_mutex_lock(&s.lock);
+
+	for(size_t i = 0; i <= s.index->mask; ++i)
+	{
+		Multicast *mc = s.index->slot[i];
 
-	MulticastStack::mclookup_t::const_iterator it = s.table.begin();
+		if(mc != NULL && mc != TOMB())
+			os << std::endl << *mc;
+	}
 
-	for(; it != s.table.end(); ++it)
-		os << std::endl << (*it->second);
+	os << std::endl << "-- Groups " << s.used << ", slots " << s.index->mask + 1
+		<< " --";
 
-	pthread_rwlock_unlock(&s.lock);
+	pthread_mutex_unlock(&s.lock);
 
 	return os;
 }
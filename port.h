@@ -32,6 +32,10 @@
 #define _PORT_H_
 
 
+#include "driver.h"
+#include "ring.h"
+#include "busy.h"
+
 #include <sys/types.h>
 
 #include <pcap.h>
@@ -45,6 +49,57 @@
 #include <iostream>
 
 
+#if RX_BURST <= 0
+# 	define RX_BURST 										32 		// frames per receive
+#endif
+
+#define RX_BURST_MAX 									256
+
+#define RX_WORKERS_MAX 								64 		// receivers per interface
+
+#if TX_BATCH <= 0
+# 	define TX_BATCH 										64 		// frames per egress flush
+#endif
+
+#if PORT_MAX <= 0
+# 	define PORT_MAX 										256 	// interfaces
+#endif
+
+#if MCAST_TABLE_SIZE <= 0
+# 	define MCAST_TABLE_SIZE 						1024 	// initial slots, power of 2
+#endif
+
+#if TXQ_DEPTH <= 0
+# 	define TXQ_DEPTH 									512 	// frames per receiver/egress pair
+#endif
+
+#ifndef CACHE_LINE
+# 	define CACHE_LINE 								64
+#endif
+
+
+// Fixed-width set of interfaces by index, fan-out walks the set bits.
+// The concurrent methods work a word at a time.
+class PortMask
+{
+public:
+	enum { WORDS = (PORT_MAX + 63) / 64 };
+private:
+	u_int64_t w[WORDS];
+public:
+	PortMask();
+public: // non-concurrent //
+	void set(int i);
+	void clear(int i); 								// -1 ignored
+	bool test(int i) const;
+	bool empty() const;
+	int next(int i) const; 						// first set after i, -1 if none
+public: // concurrent //
+	void add(int i);
+	void remove(int i);
+	PortMask load() const;
+};
+
 class Port
 {
 private:
@@ -54,49 +109,159 @@ private:
 	int assignId();
 private:
 	int id;
+	bool down; 												// error-disabled
+protected:
+	int bit; 													// in a PortMask, -1 if none
 public:
 	Port();
 
 	virtual void send(const u_int8_t *frame, size_t len, const Port *in) = 0;
 	virtual void send(const u_int8_t *frame, size_t len) = 0;
+	virtual void send(const Frame &f, const Port *in); 	// keeps f.ref
 
 	virtual const char *name() const = 0;
 
 	bool same(const Port *p);
+	int slot() const;
+
+	void setDown(bool d);
+	bool isDown() const;
+};
+
+class Interface;
+
+// Frames from one receiver thread to one egress worker, each holding its
+// buffer. Only the producer writes the counters.
+struct TxQueue
+{
+	Ring<Frame> ring;
+	unsigned long drops;
+	size_t peak;
+	const Interface *from;
+	size_t worker; 										// receiver of from
+
+	TxQueue(size_t depth, const Interface *in, size_t w);
 };
 
+// With queues set, frames sent from a TxBatch thread are queued per
+// receiver and sent by the port's own TX worker, so a slow egress only
+// fills its queues. Full queues drop the new frame, or make the ingress
+// wait. Received frames the driver does not count are then copied into
+// the FramePool, a flood holds one buffer from every queue.
+//
+// The `workers' option gives a port several receivers, each with its own
+// driver in one PACKET_FANOUT group, a flow stays on one of them. Every
+// receiver is a producer of its own, numbered across the InterfaceStack.
 class Interface : public Port
 {
-	enum { SNAPLEN = IP_MAXPACKET + LIBNET_ETH_H };
 private:
-	unsigned long recvB, sentB;
-	unsigned long recvF, sentF;
+	struct Receiver
+	{
+		Driver *drv;
+		Frame *rx;
+		size_t nrx;
+		unsigned long bytes, frames, calls;
+		bool busy, device; 							// polled, in the kernel too
+		PollStats poll;
+	} __attribute__((aligned(CACHE_LINE)));
+private:
+	unsigned long sentB;
+	unsigned long sentF;
 private:
 	pthread_mutex_t mutexSent;
 private:
-	bool opened;
-	pcap_t *fp;
-	pcap_pkthdr hdr;
+	Driver *drv; 											// sends, first receiver's
 	std::string ifnm;
+	size_t idx;
+	size_t prod; 											// first receiver's producer
+private:
+	size_t burst;
+	std::vector<Receiver *> rxs;
+private:
+	std::vector<TxQueue *> txq; 			// by producer, empty if none
+	bool txWait;
+	bool txSleep;
+	pthread_mutex_t txMutex;
+	pthread_cond_t txCond;
+private:
+	bool pending() const;
 public:
-	const u_int8_t * receive();
-public:
-	Interface(const char *nm);
+	Interface(const char *nm, size_t index, size_t producer,
+			const DriverConfig &c);
 	virtual ~Interface();
 public: // concurrent (boradcast) //
 	void send(const u_int8_t *frame, size_t len, const Port *in);
 	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame &f, const Port *in);
+	void send(const Frame &f);
+	void send(const Frame *f, size_t n);
+public: // concurrent (receiver thread of producer in) //
+	void enqueue(size_t in, const Frame &f);
+	void wake();
+public: // concurrent (receiver thread of worker) //
+	size_t recv(size_t worker, const Frame **frames);
+	Frame * received(size_t worker, const Frame &f) const; 	// slot of f, else NULL
+	bool polling(size_t worker) const;
+	PollStats & pollStats(size_t worker);
 public: // non-concurrent
-	const u_int8_t * recv(size_t *len);
+	int nonblock(size_t worker); 			// Driver::nonblock(), throws
+	void busyPoll(size_t worker, unsigned usec); 	// throws
+	bool setBurst(size_t n);
+	void setQueues(const std::vector<Interface *> &ports, size_t depth,
+			bool wait); 										// before traffic
+
+	bool queued() const;
+	bool drain(); 										// TX worker, false if nothing
+	void idle(); 											// TX worker, until wake()
 
 	const char *name() const;
+	const char *driver() const;
+	Driver * backend() const;
+	size_t index() const; 						// in InterfaceStack
+	size_t workers() const;
+	size_t producer(size_t worker) const;
 
 	unsigned long statSentBytes() const;
 	unsigned long statSentFrames() const;
 	unsigned long statRecvBytes() const;
 	unsigned long statRecvFrames() const;
+	unsigned long statRecvCalls() const;
+
+	void showQueues(std::ostream &os) const;
+	void showPolls(std::ostream &os) const;
+};
+
+// Frames sent by one thread, gathered per egress and handed to each
+// driver at once on flush(). They must stay valid until then. Ports with
+// queues take them at once, flush() wakes their workers.
+class TxBatch
+{
+private:
+	static __thread TxBatch *cur;
+private:
+	struct Queue
+	{
+		Frame frame[TX_BATCH];
+		size_t n;
+	};
+private:
+	std::vector<Queue> queue; 				// by interface index
+	std::vector<Interface *> dirty;
+	size_t in; 												// producer
+private:
+	void send(Interface *i, Queue &q);
+public:
+	static TxBatch * current();
+public:
+	TxBatch(size_t ports, size_t producer);
+
+	void attach(); 										// batch this thread's sends
+	void from(size_t producer); 			// when empty
+	void add(Interface *i, const Frame &f);
+	void flush();
 };
 
+// Floods to every interface but the ingress one.
 class Broadcast : public Port
 {
 private:
@@ -108,6 +273,7 @@ public:
 
 	void send(const u_int8_t *frame, size_t len, const Port *in);
 	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame &f, const Port *in);
 
 	const char *name() const;
 };
@@ -118,6 +284,7 @@ private:
 	static InterfaceStack ifs;
 private:
 	std::vector<Interface *> table;
+	PortMask all;
 	std::string err;
 private:
 	InterfaceStack();
@@ -126,27 +293,36 @@ public:
 public:
 	~InterfaceStack();
 
+	bool open(const std::map<std::string, DriverConfig> &cfg);
 	const std::string & error() const;
 
 	size_t size() const;
+	size_t producers() const; 				// receivers of all interfaces
 	Interface * operator [](size_t i) const;
+	Interface * find(const char *name) const;
+	const PortMask & mask() const;
+
+	void send(const PortMask &m, const Frame &f) const;
+	void setQueues(size_t depth, bool wait); 	// before traffic
 
 	friend std::ostream & operator <<(std::ostream &os, const InterfaceStack &s);
+	void showQueues(std::ostream &os) const;
+	void showPolls(std::ostream &os) const;
 };
 
 
 
 
 
+// Members join and leave bit by bit, senders read the mask without a
+// lock. The querier always gets the group's traffic.
 class Multicast : public Port
 {
 private:
 	static Interface *qrr;
 private:
-	std::set<Interface *> table;
+	PortMask table;
 	u_int32_t grp;
-private:
-	mutable pthread_rwlock_t lock;
 public:
 	static void setQuerier(Interface *querier);
 public:
@@ -158,25 +334,51 @@ public:
 
 	void send(const u_int8_t *frame, size_t len, const Port *in);
 	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame &f, const Port *in);
 
 	const char *name() const;
+	u_int32_t group() const;
 	bool empty() const;
+	void members(std::vector<Interface *> &v) const;
 
 	friend std::ostream & operator <<(std::ostream &os, const Multicast &m);
 };
 
-// CONCURRENT !!!
+struct MulticastRecord
+{
+	u_int32_t group;
+	Interface *port;
+};
+
+// Groups are found without a lock in an open-addressing table of group
+// pointers, writers serialize on a mutex and replace the table as a
+// whole when it fills up with groups or tombstones. An emptied group is
+// unlinked at once and freed through the Epoch, so find() callers and
+// the users of what it returned must be inside one.
 class MulticastStack
 {
-	typedef std::map<u_int32_t, Multicast *> mclookup_t;
+private:
+	struct Index
+	{
+		Multicast **slot;
+		size_t mask;
+	};
 private:
 	static MulticastStack mst;
 	MulticastStack();
 private:
-	mutable pthread_rwlock_t lock;
+	mutable pthread_mutex_t lock; 	// writers only
 private:
-	mclookup_t table;
+	Index *index;
+	size_t used, dead; 								// groups, tombstones
 	Interface *qr;
+private:
+	static Index * newIndex(size_t slots);
+	static void freeIndex(void *ix);
+	static void freeGroup(void *mc);
+
+	size_t lookup(u_int32_t group) const; 	// slot, or the empty one
+	void rebuild(size_t slots);
 public:
 	static MulticastStack & instance();
 public:
@@ -186,14 +388,85 @@ public:
 	void sendResponse(const u_int8_t *frame, size_t len, const Port *in);
 
 	Multicast * find(u_int32_t group) const;
-	Multicast * operator [](u_int32_t group);
+
+	bool join(u_int32_t group, Interface *p);
+	void leave(u_int32_t group, Interface *p);
 
 	Interface * getQuerier() const;
+	void setQuerier(Interface *querier);
 
-	void cleanup();
+	void records(std::vector<MulticastRecord> &r) const;
 
 	friend std::ostream & operator <<(std::ostream &os, const MulticastStack &s);
 };
 
 
+inline PortMask::PortMask()
+{
+	for(size_t k = 0; k < WORDS; ++k)
+		w[k] = 0;
+}
+
+inline void PortMask::set(int i)
+{
+	w[i >> 6] |= (u_int64_t)1 << (i & 63);
+}
+
+inline void PortMask::clear(int i)
+{
+	if(i >= 0) w[i >> 6] &= ~((u_int64_t)1 << (i & 63));
+}
+
+inline bool PortMask::test(int i) const
+{
+	return w[i >> 6] >> (i & 63) & 1;
+}
+
+inline bool PortMask::empty() const
+{
+	for(size_t k = 0; k < WORDS; ++k)
+		if(w[k]) return false;
+
+	return true;
+}
+
+inline int PortMask::next(int i) const
+{
+	if(++i >= PORT_MAX) return -1;
+
+	size_t k = i >> 6;
+	u_int64_t b = w[k] & (~(u_int64_t)0 << (i & 63));
+
+	while(!b)
+	{
+		if(++k == WORDS) return -1;
+
+		b = w[k];
+	}
+
+	return k << 6 | __builtin_ctzll(b);
+}
+
+inline void PortMask::add(int i)
+{
+	__atomic_or_fetch(&w[i >> 6], (u_int64_t)1 << (i & 63), __ATOMIC_RELEASE);
+}
+
+inline void PortMask::remove(int i)
+{
+	__atomic_and_fetch(&w[i >> 6], ~((u_int64_t)1 << (i & 63)),
+			__ATOMIC_RELEASE);
+}
+
+inline PortMask PortMask::load() const
+{
+	PortMask m;
+
+	for(size_t k = 0; k < WORDS; ++k)
+		m.w[k] = __atomic_load_n(&w[k], __ATOMIC_ACQUIRE);
+
+	return m;
+}
+
+
 #endif /* _PORT_H_ */
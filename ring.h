@@ -0,0 +1,150 @@
+//===================================================================
+// File:        ring.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    Bounded single-producer/single-consumer queue
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _RING_H_
+#define _RING_H_
+
+
+#include <cstddef>
+
+
+#ifndef CACHE_LINE
+# 	define CACHE_LINE 								64
+#endif
+
+
+// Lock-free for exactly one producer and one consumer thread.
+template<typename T>
+class Ring
+{
+private:
+	T *buf;
+	size_t mask;
+private:
+	size_t head __attribute__((aligned(CACHE_LINE))); 	// consumer
+	size_t tailCache;
+private:
+	size_t tail __attribute__((aligned(CACHE_LINE))); 	// producer
+	size_t headCache;
+private:
+	Ring(const Ring &);
+	Ring & operator =(const Ring &);
+public:
+	Ring(size_t size);
+	~Ring();
+public: // producer //
+	bool push(const T &v);
+public: // consumer //
+	bool pop(T &v);
+	size_t pop(T *v, size_t n);
+public: // any //
+	size_t size() const;
+	size_t capacity() const;
+};
+
+
+template<typename T>
+Ring<T>::Ring(size_t size)
+:
+	head(0), tailCache(0), tail(0), headCache(0)
+{
+	size_t n = 1;
+
+	while(n < size)
+		n <<= 1;
+
+	buf = new T[n];
+	mask = n - 1;
+}
+
+template<typename T>
+Ring<T>::~Ring()
+{
+	delete [] buf;
+}
+
+template<typename T>
+bool Ring<T>::push(const T &v)
+{
+	if(tail - headCache > mask)
+	{
+		headCache = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+		if(tail - headCache > mask)
+			return false; 								// full
+	}
+
+	buf[tail & mask] = v;
+
+	__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+template<typename T>
+bool Ring<T>::pop(T &v)
+{
+	return pop(&v, 1) == 1;
+}
+
+template<typename T>
+size_t Ring<T>::pop(T *v, size_t n)
+{
+	if(tailCache - head < n)
+		tailCache = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+
+	size_t avail = tailCache - head;
+
+	if(n > avail)
+		n = avail;
+
+	for(size_t i = 0; i < n; ++i)
+		v[i] = buf[(head + i) & mask];
+
+	__atomic_store_n(&head, head + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+template<typename T>
+size_t Ring<T>::size() const
+{
+	return __atomic_load_n(&tail, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+size_t Ring<T>::capacity() const
+{
+	return mask + 1;
+}
+
+
+#endif /* _RING_H_ */
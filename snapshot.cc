@@ -0,0 +1,281 @@
+//===================================================================
+// File:        snapshot.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    CAM and multicast warm-start snapshot
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "snapshot.h"
+#include "cam.h"
+#include "port.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <map>
+#include <vector>
+
+
+static const char MAGIC[8] = { 'S', 'E', 'S', 'S', 'N', 'A', 'P', '\0' };
+
+
+Snapshot::Snapshot(const char *file, bool groups)
+:
+	path(file), err(""), mcast(groups)
+{
+}
+
+bool Snapshot::fail(const char *what)
+{
+	err = std::string("Snapshot(): ") + what + "(): " + path + ": "
+		+ strerror(errno);
+
+	return false;
+}
+
+const std::string & Snapshot::error() const
+{
+	return err;
+}
+
+// Written to a temporary file and renamed, a crash never leaves a torn
+// snapshot behind.
+bool Snapshot::save()
+{
+	std::vector<CAMRecord> cam;
+	std::vector<MulticastRecord> grp;
+	Interface *qr = NULL;
+
+	CAMTable::instance().records(cam);
+
+	if(mcast)
+	{
+		MulticastStack &ms = MulticastStack::instance();
+
+		ms.records(grp);
+		qr = ms.getQuerier();
+	}
+
+	std::map<const Port *, u_int32_t> number;
+	std::vector<const Port *> ports;
+
+	for(size_t i = 0; i < cam.size(); ++i)
+		if(number.insert(std::make_pair(cam[i].port, ports.size())).second)
+			ports.push_back(cam[i].port);
+
+	for(size_t i = 0; i < grp.size(); ++i)
+		if(number.insert(std::make_pair(grp[i].port, ports.size())).second)
+			ports.push_back(grp[i].port);
+
+	if(qr && number.insert(std::make_pair(qr, ports.size())).second)
+		ports.push_back(qr);
+
+	size_t size = sizeof(Header) + ports.size() * NAMELEN
+		+ cam.size() * sizeof(CAMSlot) + grp.size() * sizeof(GroupSlot);
+
+	std::string tmp = path + ".tmp";
+
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if(fd == -1)
+		return fail("open");
+
+	if(ftruncate(fd, size) == -1)
+	{
+		close(fd);
+		return fail("ftruncate");
+	}
+
+	u_int8_t *m = (u_int8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if(m == MAP_FAILED)
+		return fail("mmap");
+
+	Header *h = (Header *)m;
+
+	memcpy(h->magic, MAGIC, sizeof(MAGIC));
+	h->version = VERSION;
+	h->ports = ports.size();
+	h->cam = cam.size();
+	h->groups = grp.size();
+	h->saved = CoarseClock::now();
+	h->querier = qr ? number[qr] + 1 : 0;
+	h->reserved = 0;
+
+	char *name = (char *)(h + 1);
+
+	for(size_t i = 0; i < ports.size(); ++i, name += NAMELEN)
+		strncpy(name, ports[i]->name(), NAMELEN);
+
+	CAMSlot *cs = (CAMSlot *)name;
+
+	for(size_t i = 0; i < cam.size(); ++i, ++cs)
+	{
+		memcpy(cs->mac, (const u_int8_t *)cam[i].mac, sizeof(cs->mac));
+		cs->port = number[cam[i].port];
+		cs->age = cam[i].age;
+	}
+
+	GroupSlot *gs = (GroupSlot *)cs;
+
+	for(size_t i = 0; i < grp.size(); ++i, ++gs)
+	{
+		gs->group = grp[i].group;
+		gs->port = number[grp[i].port];
+	}
+
+	bool ok = msync(m, size, MS_SYNC) == 0 || fail("msync");
+
+	munmap(m, size);
+
+	if(ok && rename(tmp.c_str(), path.c_str()) == -1)
+		return fail("rename");
+
+	return ok;
+}
+
+// Ports that no longer exist are skipped, entries age by the downtime.
+bool Snapshot::restore()
+{
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if(fd == -1)
+		return fail("open");
+
+	struct stat st;
+
+	if(fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return fail("fstat");
+	}
+
+	size_t size = st.st_size;
+
+	if(size < sizeof(Header))
+	{
+		close(fd);
+		err = "Snapshot(): " + path + ": truncated file";
+		return false;
+	}
+
+	const u_int8_t *m = (const u_int8_t *)mmap(NULL, size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if(m == MAP_FAILED)
+		return fail("mmap");
+
+	const Header *h = (const Header *)m;
+
+	// Each count is checked against what is left before it is multiplied,
+	// a crafted one cannot wrap the size around.
+	size_t left = size - sizeof(Header);
+	bool ok = !memcmp(h->magic, MAGIC, sizeof(MAGIC)) && h->version == VERSION;
+
+	if(ok && (ok = h->ports <= left / NAMELEN))
+		left -= h->ports * NAMELEN;
+
+	if(ok && (ok = h->cam <= left / sizeof(CAMSlot)))
+		left -= h->cam * sizeof(CAMSlot);
+
+	if(ok)
+		ok = h->groups <= left / sizeof(GroupSlot)
+			&& left == h->groups * sizeof(GroupSlot);
+
+	if(!ok)
+	{
+		munmap((void *)m, size);
+		err = "Snapshot(): " + path + ": not a snapshot";
+		return false;
+	}
+
+	InterfaceStack &ifs = InterfaceStack::instance();
+
+	std::vector<Interface *> ports(h->ports);
+
+	const char *name = (const char *)(h + 1);
+
+	for(size_t i = 0; i < h->ports; ++i, name += NAMELEN)
+	{
+		char nm[NAMELEN + 1];
+
+		memcpy(nm, name, NAMELEN);
+		nm[NAMELEN] = '\0';
+
+		ports[i] = ifs.find(nm);
+	}
+
+	time_t down = CoarseClock::now() - (time_t)h->saved;
+
+	if(down < 0) down = 0;
+
+	std::vector<CAMRecord> cam;
+
+	const CAMSlot *cs = (const CAMSlot *)name;
+
+	for(size_t i = 0; i < h->cam; ++i, ++cs)
+	{
+		if(cs->port >= h->ports || ports[cs->port] == NULL)
+			continue;
+
+		CAMRecord rec;
+
+		rec.mac = cs->mac;
+		rec.port = ports[cs->port];
+		rec.age = cs->age + down;
+
+		cam.push_back(rec);
+	}
+
+	if(!cam.empty())
+		CAMTable::instance().restore(&cam[0], cam.size());
+
+	const GroupSlot *gs = (const GroupSlot *)cs;
+
+	if(mcast && h->querier && h->querier <= h->ports && ports[h->querier - 1])
+	{
+		MulticastStack &ms = MulticastStack::instance();
+
+		ms.setQuerier(ports[h->querier - 1]);
+
+		for(size_t i = 0; i < h->groups; ++i, ++gs)
+			if(gs->port < h->ports && ports[gs->port] != NULL)
+				ms.join(gs->group, ports[gs->port]);
+	}
+
+	munmap((void *)m, size);
+
+	return true;
+}
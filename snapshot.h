@@ -0,0 +1,91 @@
+//===================================================================
+// File:        snapshot.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    CAM and multicast warm-start snapshot
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+
+#include <sys/types.h>
+
+#include <string>
+
+
+#if DEFAULT_SNAPSHOT <= 0
+# 	define DEFAULT_SNAPSHOT 			300 	// seconds
+#endif
+
+
+// Memory-mapped image of the learned addresses (and group memberships),
+// ports are stored by interface name and matched on restore.
+class Snapshot
+{
+private:
+	enum { VERSION = 1, NAMELEN = 16 };
+private:
+	struct Header
+	{
+		char magic[8];
+		u_int32_t version;
+		u_int32_t ports;
+		u_int64_t cam;
+		u_int64_t groups;
+		u_int64_t saved; 								// time of the snapshot
+		u_int32_t querier; 							// port + 1, 0 if none
+		u_int32_t reserved;
+	};
+	struct CAMSlot
+	{
+		u_int8_t mac[6];
+		u_int16_t port;
+		u_int32_t age; 									// seconds at save time
+	};
+	struct GroupSlot
+	{
+		u_int32_t group;
+		u_int32_t port;
+	};
+private:
+	std::string path;
+	std::string err;
+	bool mcast;
+private:
+	bool fail(const char *what);
+public:
+	Snapshot(const char *file, bool groups);
+
+	const std::string & error() const;
+public: 	// concurrent //
+	bool save();
+public: 	// init //
+	bool restore();
+};
+
+
+#endif /* _SNAPSHOT_H_ */
@@ -0,0 +1,479 @@
+//===================================================================
+// File:        uring.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    io_uring packet socket backend
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+
+
+inline static std::string ERR(const char *call)
+{
+	return std::string(call) + "(): " + strerror(errno);
+}
+
+inline static bool POW2(size_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+inline static int ENTER(Uring &u, unsigned submit, unsigned wait)
+{
+	return syscall(__NR_io_uring_enter, u.fd, submit, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+inline static void SETUP(Uring &u, unsigned entries)
+{
+	io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(&u, 0, sizeof(u));
+
+	if((u.fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		throw ERR("io_uring_setup");
+
+	u.entries = p.sq_entries;
+	u.sqLen = p.sq_off.array + p.sq_entries * sizeof(u_int32_t);
+	u.cqLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		u.sqLen = u.cqLen = u.sqLen > u.cqLen ? u.sqLen : u.cqLen;
+
+	u.sqMap = mmap(NULL, u.sqLen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_SQ_RING);
+
+	if(u.sqMap == MAP_FAILED)
+	{
+		u.sqMap = NULL;
+
+		throw ERR("mmap(sq)");
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		u.cqMap = u.sqMap;
+	else if((u.cqMap = mmap(NULL, u.cqLen, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	{
+		u.cqMap = NULL;
+
+		throw ERR("mmap(cq)");
+	}
+
+	void *s = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_SQES);
+
+	if(s == MAP_FAILED)
+		throw ERR("mmap(sqes)");
+
+	u_int8_t *sq = (u_int8_t *)u.sqMap;
+	u_int8_t *cq = (u_int8_t *)u.cqMap;
+
+	u.sqHead = (u_int32_t *)(sq + p.sq_off.head);
+	u.sqTail = (u_int32_t *)(sq + p.sq_off.tail);
+	u.sqMask = (u_int32_t *)(sq + p.sq_off.ring_mask);
+	u.sqArray = (u_int32_t *)(sq + p.sq_off.array);
+	u.sqes = (io_uring_sqe *)s;
+
+	u.cqHead = (u_int32_t *)(cq + p.cq_off.head);
+	u.cqTail = (u_int32_t *)(cq + p.cq_off.tail);
+	u.cqMask = (u_int32_t *)(cq + p.cq_off.ring_mask);
+	u.cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+inline static void CLOSE(Uring &u)
+{
+	if(u.sqes) munmap(u.sqes, u.entries * sizeof(io_uring_sqe));
+	if(u.cqMap && u.cqMap != u.sqMap) munmap(u.cqMap, u.cqLen);
+	if(u.sqMap) munmap(u.sqMap, u.sqLen);
+	if(u.fd > 0) close(u.fd);
+
+	memset(&u, 0, sizeof(u));
+}
+
+// Next free entry, published by SUBMIT().
+inline static io_uring_sqe * SQE(Uring &u, unsigned i)
+{
+	u_int32_t t = (*u.sqTail + i) & *u.sqMask;
+
+	u.sqArray[t] = t;
+
+	memset(&u.sqes[t], 0, sizeof(io_uring_sqe));
+
+	return &u.sqes[t];
+}
+
+inline static void SUBMIT(Uring &u, unsigned n)
+{
+	__atomic_store_n(u.sqTail, *u.sqTail + n, __ATOMIC_RELEASE);
+}
+
+// Takes back the published entries the kernel has not consumed yet.
+inline static void UNSUBMIT(Uring &u)
+{
+	__atomic_store_n(u.sqTail, __atomic_load_n(u.sqHead, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+}
+
+inline static io_uring_cqe * CQE(Uring &u)
+{
+	u_int32_t h = *u.cqHead;
+
+	if(h == __atomic_load_n(u.cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u.cqes[h & *u.cqMask];
+}
+
+inline static void SEEN(Uring &u)
+{
+	__atomic_store_n(u.cqHead, *u.cqHead + 1, __ATOMIC_RELEASE);
+}
+
+
+UringDriver::UringDriver(const char *ifname, const DriverConfig &c)
+:
+	sock(-1), bufRing(NULL), bufs(NULL), armed(false), nowait(false)
+{
+	c.check("entries bufs buf");
+
+	size_t entries = c.get("entries", URING_ENTRIES);
+
+	nbufs = c.get("bufs", URING_BUFS);
+	bufSize = c.get("buf", URING_BUF_SIZE);
+
+	if(!POW2(entries) || !POW2(nbufs) || nbufs > 32768 || bufSize < 256)
+		throw std::string("invalid ring geometry");
+
+	memset(&rx, 0, sizeof(rx));
+	memset(&tx, 0, sizeof(tx));
+
+	pthread_mutex_init(&txLock, NULL);
+
+	unsigned ifindex = if_nametoindex(ifname);
+
+	if(ifindex == 0)
+		throw ERR("if_nametoindex");
+
+	try
+	{
+		if((sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) == -1)
+			throw ERR("socket");
+
+		sockaddr_ll ll;
+
+		memset(&ll, 0, sizeof(ll));
+
+		ll.sll_family = AF_PACKET;
+		ll.sll_protocol = htons(ETH_P_ALL);
+		ll.sll_ifindex = ifindex;
+
+		packet_mreq mr;
+
+		memset(&mr, 0, sizeof(mr));
+
+		mr.mr_ifindex = ifindex;
+		mr.mr_type = PACKET_MR_PROMISC;
+
+		if(bind(sock, (sockaddr *)&ll, sizeof(ll)) == -1
+				|| setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr))
+					== -1)
+			throw ERR("bind");
+
+		SETUP(rx, entries);
+		SETUP(tx, entries);
+
+		txMsg.resize(tx.entries);
+		txIov.resize(tx.entries);
+
+		// Provided buffers, group 0
+
+		void *m = mmap(NULL, nbufs * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if(m == MAP_FAILED)
+			throw ERR("mmap");
+
+		bufRing = (io_uring_buf_ring *)m;
+
+		if((m = mmap(NULL, nbufs * bufSize, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0)) == MAP_FAILED)
+			throw ERR("mmap");
+
+		bufs = (u_int8_t *)m;
+
+		io_uring_buf_reg reg;
+
+		memset(&reg, 0, sizeof(reg));
+
+		reg.ring_addr = (u_int64_t)bufRing;
+		reg.ring_entries = nbufs;
+		reg.bgid = 0;
+
+		if(syscall(__NR_io_uring_register, rx.fd, IORING_REGISTER_PBUF_RING,
+					&reg, 1) == -1)
+			throw ERR("io_uring_register(IORING_REGISTER_PBUF_RING)");
+
+		for(size_t i = 0; i < nbufs; ++i)
+			pending.push_back(i);
+
+		give();
+
+		// The kernel lays out each buffer as io_uring_recvmsg_out, the
+		// address, then the frame.
+
+		memset(&rxMsg, 0, sizeof(rxMsg));
+
+		rxMsg.msg_namelen = sizeof(sockaddr_ll);
+	}
+	catch(const std::string &)
+	{
+		shut();
+
+		throw;
+	}
+}
+
+UringDriver::~UringDriver()
+{
+	shut();
+}
+
+void UringDriver::shut()
+{
+	CLOSE(rx);
+	CLOSE(tx);
+
+	if(bufRing) munmap(bufRing, nbufs * sizeof(io_uring_buf));
+	if(bufs) munmap(bufs, nbufs * bufSize);
+	if(sock != -1) close(sock);
+
+	bufRing = NULL;
+	bufs = NULL;
+	sock = -1;
+}
+
+// A multishot recvmsg ends when the buffers run out, it is armed again
+// once they are given back.
+void UringDriver::arm()
+{
+	io_uring_sqe *s = SQE(rx, 0);
+
+	s->opcode = IORING_OP_RECVMSG;
+	s->fd = sock;
+	s->addr = (u_int64_t)&rxMsg;
+	s->ioprio = IORING_RECV_MULTISHOT;
+	s->flags = IOSQE_BUFFER_SELECT;
+	s->buf_group = 0;
+
+	SUBMIT(rx, 1);
+
+	armed = ENTER(rx, 1, 0) == 1;
+}
+
+// The entries are indexed from the ring base, in C++ the flexible array
+// of io_uring_buf_ring does not start there.
+void UringDriver::give()
+{
+	u_int16_t t = bufRing->tail;
+
+	for(size_t i = 0; i < pending.size(); ++i)
+	{
+		io_uring_buf &b = ((io_uring_buf *)bufRing)[(t + i) & (nbufs - 1)];
+
+		b.addr = (u_int64_t)(bufs + pending[i] * bufSize);
+		b.len = bufSize;
+		b.bid = pending[i];
+	}
+
+	__atomic_store_n(&bufRing->tail, t + pending.size(), __ATOMIC_RELEASE);
+
+	pending.clear();
+}
+
+size_t UringDriver::recv(Frame *f, size_t n)
+{
+	give();
+
+	if(!armed)
+		arm();
+
+	io_uring_cqe *e;
+
+	if((e = CQE(rx)) == NULL)
+	{
+		if(!nowait)
+			ENTER(rx, 0, 1);
+
+		if((e = CQE(rx)) == NULL)
+			return 0;
+	}
+
+	size_t k = 0;
+
+	for(; e != NULL && k < n; e = CQE(rx))
+	{
+		if(!(e->flags & IORING_CQE_F_MORE))
+			armed = false;
+
+		if(e->flags & IORING_CQE_F_BUFFER)
+		{
+			u_int16_t bid = e->flags >> IORING_CQE_BUFFER_SHIFT;
+			u_int8_t *b = bufs + bid * bufSize;
+
+			io_uring_recvmsg_out *o = (io_uring_recvmsg_out *)b;
+			sockaddr_ll *ll = (sockaddr_ll *)(o + 1);
+
+			pending.push_back(bid);
+
+			if(e->res > 0 && !(o->flags & MSG_TRUNC)
+					&& ll->sll_pkttype != PACKET_OUTGOING) 	// own sends
+			{
+				f[k].data = (u_int8_t *)(o + 1) + rxMsg.msg_namelen;
+				f[k].len = o->payloadlen;
+				f[k].ref = NULL;
+
+				++k;
+			}
+		}
+
+		SEEN(rx);
+	}
+
+	if(nowait && !armed) 							// nothing else would wake us
+		arm();
+
+	return k;
+}
+
+void UringDriver::send(const u_int8_t *frame, size_t len)
+{
+	Frame f;
+
+	f.data = frame;
+	f.len = len;
+	f.ref = NULL;
+
+	send(&f, 1);
+}
+
+// Usually one io_uring_enter() per ring full of frames. The kernel may
+// consume fewer entries than offered, the rest are offered again and only
+// what it took is waited for. Returns with the sends completed, so the
+// frames need not outlive the call. On a hard error the entries not yet
+// taken are withdrawn and the remaining frames dropped, the sends already
+// taken are still waited for so their completions stay in this call.
+void UringDriver::send(const Frame *f, size_t n)
+{
+	pthread_mutex_lock(&txLock);
+
+	while(n)
+	{
+		unsigned m = n < tx.entries ? n : tx.entries;
+
+		for(unsigned i = 0; i < m; ++i)
+		{
+			txIov[i].iov_base = (void *)f[i].data;
+			txIov[i].iov_len = f[i].len;
+
+			memset(&txMsg[i], 0, sizeof(msghdr));
+
+			txMsg[i].msg_iov = &txIov[i];
+			txMsg[i].msg_iovlen = 1;
+
+			io_uring_sqe *s = SQE(tx, i);
+
+			s->opcode = IORING_OP_SENDMSG;
+			s->fd = sock;
+			s->addr = (u_int64_t)&txMsg[i];
+			s->msg_flags = MSG_DONTWAIT;
+		}
+
+		SUBMIT(tx, m);
+
+		unsigned sub = 0, done = 0;
+
+		while(sub < m || done < sub)
+		{
+			int r = ENTER(tx, m - sub, done < sub ? 1 : 0);
+
+			if(r > 0)
+				sub += r;
+			else if(r == -1 && errno != EINTR && errno != EAGAIN
+					&& errno != EBUSY && sub < m)
+			{
+				UNSUBMIT(tx); 								// the taken ones still complete
+
+				n = m = sub;
+			}
+
+			while(CQE(tx) != NULL) 				// failed sends are dropped
+			{
+				SEEN(tx);
+				++done;
+			}
+		}
+
+		f += m;
+		n -= m;
+	}
+
+	pthread_mutex_unlock(&txLock);
+}
+
+int UringDriver::fanout(int group)
+{
+	return join(sock, group);
+}
+
+// The ring polls readable with completions, so the receive is armed now
+// and again whenever it ends.
+int UringDriver::nonblock()
+{
+	nowait = true;
+
+	if(!armed)
+		arm();
+
+	return rx.fd;
+}
+
+const char * UringDriver::type() const
+{
+	return "uring";
+}
@@ -0,0 +1,114 @@
+//===================================================================
+// File:        uring.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    io_uring packet socket backend
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _URING_H_
+#define _URING_H_
+
+
+#include "driver.h"
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+
+#include <vector>
+
+
+#if URING_ENTRIES <= 0
+# 	define URING_ENTRIES 							256
+#endif
+
+#if URING_BUFS <= 0
+# 	define URING_BUFS 								1024
+#endif
+
+#if URING_BUF_SIZE <= 0
+# 	define URING_BUF_SIZE 						2048
+#endif
+
+
+// Submission and completion queues of one io_uring, mapped.
+struct Uring
+{
+	int fd;
+	unsigned entries;
+	u_int32_t *sqHead, *sqTail, *sqMask, *sqArray;
+	io_uring_sqe *sqes;
+	u_int32_t *cqHead, *cqTail, *cqMask;
+	io_uring_cqe *cqes;
+	void *sqMap, *cqMap;
+	size_t sqLen, cqLen;
+};
+
+// A packet socket driven by two io_urings. One multishot recvmsg keeps
+// receiving into a ring of provided buffers, a burst is reaped from the
+// completion queue without a syscall while there is one. The buffers go
+// back to the kernel on the next recv(). Sends are submitted as a batch
+// of sendmsg and waited for in the same io_uring_enter(). Every port has
+// rings of its own, one thread serving the rings of several ports is not
+// done.
+class UringDriver : public Driver
+{
+private:
+	int sock;
+private:
+	Uring rx;
+	io_uring_buf_ring *bufRing;
+	u_int8_t *bufs;
+	size_t nbufs, bufSize;
+	std::vector<u_int16_t> pending; 	// delivered, not given back
+	msghdr rxMsg;
+	bool armed;
+	bool nowait;
+private:
+	pthread_mutex_t txLock;
+	Uring tx;
+	std::vector<msghdr> txMsg;
+	std::vector<iovec> txIov;
+private:
+	void shut();
+	void arm();
+	void give();
+public:
+	UringDriver(const char *ifname, const DriverConfig &c);
+	~UringDriver();
+
+	size_t recv(Frame *f, size_t n);
+	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame *f, size_t n);
+
+	int fanout(int group);
+	int nonblock();
+
+	const char *type() const;
+};
+
+
+#endif /* _URING_H_ */
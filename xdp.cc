@@ -0,0 +1,674 @@
+//===================================================================
+// File:        xdp.cc
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    AF_XDP socket backend
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#include "xdp.h"
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <cstddef>
+
+
+#ifndef AF_XDP
+# 	define AF_XDP 										44
+#endif
+
+#ifndef SOL_XDP
+# 	define SOL_XDP 										283
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+# 	define SO_PREFER_BUSY_POLL 					69
+#endif
+
+
+Umem *Umem::um = NULL;
+
+
+inline static std::string ERR(const char *call)
+{
+	return std::string(call) + "(): " + strerror(errno);
+}
+
+inline static int BPF(int cmd, bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+inline static u_int32_t READY(const XskRing &r) 		// consumer side
+{
+	return __atomic_load_n(r.producer, __ATOMIC_ACQUIRE) - *r.consumer;
+}
+
+inline static u_int32_t ROOM(const XskRing &r) 			// producer side
+{
+	return r.mask + 1 - (*r.producer - __atomic_load_n(r.consumer,
+				__ATOMIC_ACQUIRE));
+}
+
+inline static u_int64_t & ADDR(const XskRing &r, u_int32_t i)
+{
+	return ((u_int64_t *)r.desc)[i & r.mask];
+}
+
+inline static xdp_desc & DESC(const XskRing &r, u_int32_t i)
+{
+	return ((xdp_desc *)r.desc)[i & r.mask];
+}
+
+inline static void PRODUCE(XskRing &r, u_int32_t n)
+{
+	__atomic_store_n(r.producer, *r.producer + n, __ATOMIC_RELEASE);
+}
+
+inline static void CONSUME(XskRing &r, u_int32_t n)
+{
+	__atomic_store_n(r.consumer, *r.consumer + n, __ATOMIC_RELEASE);
+}
+
+inline static bool POW2(size_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+
+Umem::Umem(size_t n, size_t size)
+:
+	frames(n), frameSize(size), next(0), fd(-1)
+{
+	void *m = mmap(NULL, n * size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	if(m == MAP_FAILED)
+		throw ERR("mmap");
+
+	area = (u_int8_t *)m;
+	refs = new unsigned[n];
+
+	memset(refs, 0, n * sizeof(unsigned));
+}
+
+Umem * Umem::instance(const DriverConfig &c)
+{
+	if(um == NULL)
+	{
+		size_t n = c.get("umem", XSK_UMEM_FRAMES);
+		size_t size = c.get("frame", XSK_FRAME_SIZE);
+
+		if(size != 2048 && size != 4096)
+			throw std::string("frame size must be 2048 or 4096");
+
+		um = new Umem(n, size);
+	}
+
+	return um;
+}
+
+u_int64_t Umem::take(size_t n)
+{
+	if(n > frames - next)
+		throw std::string("umem exhausted");
+
+	u_int64_t a = next * frameSize;
+
+	next += n;
+
+	return a;
+}
+
+u_int8_t * Umem::data(u_int64_t addr) const
+{
+	return area + addr;
+}
+
+unsigned * Umem::ref(u_int64_t addr) const
+{
+	return &refs[addr / frameSize];
+}
+
+u_int64_t Umem::addr(const u_int8_t *p) const
+{
+	return p - area;
+}
+
+u_int64_t Umem::chunk(u_int64_t addr) const
+{
+	return addr & ~(u_int64_t)(frameSize - 1);
+}
+
+bool Umem::owns(const u_int8_t *p) const
+{
+	return p >= area && p < area + frames * frameSize;
+}
+
+size_t Umem::size() const
+{
+	return frames * frameSize;
+}
+
+size_t Umem::frameLen() const
+{
+	return frameSize;
+}
+
+int Umem::socket() const
+{
+	return fd;
+}
+
+void Umem::setSocket(int s)
+{
+	fd = s;
+}
+
+
+XdpDriver::XdpDriver(const char *ifname, const DriverConfig &c)
+:
+	fd(-1), mapfd(-1), progfd(-1), linkfd(-1), fresh(0), nowait(false),
+	kick(false)
+{
+	c.check("queue ring frames tx umem frame zc skb");
+
+	memset(&fill, 0, sizeof(fill));
+	memset(&comp, 0, sizeof(comp));
+	memset(&rx, 0, sizeof(rx));
+	memset(&tx, 0, sizeof(tx));
+
+	unsigned queue = c.get("queue", 0);
+	size_t ringSize = c.get("ring", XSK_RING_SIZE);
+	size_t rxFrames = c.get("frames", XSK_RX_FRAMES);
+	size_t zc = c.get("zc", 2); 				// 2, kernel's choice
+	bool skb = c.get("skb", 0);
+
+	txFrames = c.get("tx", XSK_TX_FRAMES);
+
+	if(!POW2(ringSize) || !rxFrames || rxFrames > ringSize || !txFrames
+			|| zc > 2)
+		throw std::string("invalid ring geometry");
+
+	if((ifidx = if_nametoindex(ifname)) == 0)
+		throw ERR("if_nametoindex");
+
+	umem = Umem::instance(c);
+
+	u_int64_t rxBase = umem->take(rxFrames);
+
+	txBase = umem->take(txFrames);
+
+	for(size_t i = 0; i < txFrames; ++i)
+		txFree.push_back(txBase + i * umem->frameLen());
+
+	pthread_mutex_init(&txLock, NULL);
+
+	try
+	{
+		if((fd = ::socket(AF_XDP, SOCK_RAW, 0)) == -1)
+			throw ERR("socket");
+
+		bool first = umem->socket() == -1;
+
+		if(first)
+		{
+			xdp_umem_reg reg;
+
+			memset(&reg, 0, sizeof(reg));
+
+			reg.addr = (u_int64_t)umem->data(0);
+			reg.len = umem->size();
+			reg.chunk_size = umem->frameLen();
+
+			if(setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1)
+				throw ERR("setsockopt(XDP_UMEM_REG)");
+		}
+
+		int n = ringSize;
+
+		if(setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof(n)) == -1
+				|| setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n, sizeof(n)) == -1
+				|| setsockopt(fd, SOL_XDP, XDP_RX_RING, &n, sizeof(n)) == -1
+				|| setsockopt(fd, SOL_XDP, XDP_TX_RING, &n, sizeof(n)) == -1)
+			throw ERR("setsockopt(rings)");
+
+		xdp_mmap_offsets off;
+		socklen_t len = sizeof(off);
+
+		if(getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1)
+			throw ERR("getsockopt(XDP_MMAP_OFFSETS)");
+
+		ring(fill, ringSize, off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(u_int64_t));
+		ring(comp, ringSize, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING,
+				sizeof(u_int64_t));
+		ring(rx, ringSize, off.rx, XDP_PGOFF_RX_RING, sizeof(xdp_desc));
+		ring(tx, ringSize, off.tx, XDP_PGOFF_TX_RING, sizeof(xdp_desc));
+
+		for(size_t i = 0; i < rxFrames; ++i)
+			ADDR(fill, *fill.producer + i) = rxBase + i * umem->frameLen();
+
+		PRODUCE(fill, rxFrames);
+
+		// Copy or zero-copy mode is set by the socket registering the frame
+		// memory, the others share it.
+
+		sockaddr_xdp sa;
+
+		memset(&sa, 0, sizeof(sa));
+
+		sa.sxdp_family = AF_XDP;
+		sa.sxdp_ifindex = ifidx;
+		sa.sxdp_queue_id = queue;
+
+		if(first)
+			sa.sxdp_flags = zc == 0 ? XDP_COPY : zc == 1 ? XDP_ZEROCOPY : 0;
+		else
+		{
+			sa.sxdp_flags = XDP_SHARED_UMEM;
+			sa.sxdp_shared_umem_fd = umem->socket();
+		}
+
+		if(bind(fd, (sockaddr *)&sa, sizeof(sa)) == -1)
+			throw ERR("bind");
+
+		attach(queue, skb);
+
+		if(first)
+			umem->setSocket(fd);
+	}
+	catch(const std::string &)
+	{
+		shut();
+
+		throw;
+	}
+}
+
+XdpDriver::~XdpDriver()
+{
+	shut();
+}
+
+void XdpDriver::shut()
+{
+	XskRing *r[] = { &fill, &comp, &rx, &tx };
+
+	for(size_t i = 0; i < sizeof(r) / sizeof(r[0]); ++i)
+		if(r[i]->map)
+		{
+			munmap(r[i]->map, r[i]->len);
+
+			r[i]->map = NULL;
+		}
+
+	if(linkfd != -1) close(linkfd); 		// detaches the program
+	if(progfd != -1) close(progfd);
+	if(mapfd != -1) close(mapfd);
+
+	if(fd != -1 && fd != umem->socket())
+		close(fd); 												// the first stays for the others
+
+	fd = mapfd = progfd = linkfd = -1;
+}
+
+void XdpDriver::ring(XskRing &r, size_t n, const xdp_ring_offset &o,
+		off_t pgoff, size_t esize)
+{
+	r.len = o.desc + n * esize;
+	r.map = mmap(NULL, r.len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, pgoff);
+
+	if(r.map == MAP_FAILED)
+	{
+		r.map = NULL;
+
+		throw ERR("mmap(ring)");
+	}
+
+	r.producer = (u_int32_t *)((u_int8_t *)r.map + o.producer);
+	r.consumer = (u_int32_t *)((u_int8_t *)r.map + o.consumer);
+	r.desc = (u_int8_t *)r.map + o.desc;
+	r.mask = n - 1;
+}
+
+int XdpDriver::program(const bpf_insn *insn, size_t n)
+{
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.prog_type = BPF_PROG_TYPE_XDP;
+	a.insn_cnt = n;
+	a.insns = (u_int64_t)insn;
+	a.license = (u_int64_t)"GPL";
+
+	int p = BPF(BPF_PROG_LOAD, &a);
+
+	if(p == -1)
+		throw ERR("bpf(BPF_PROG_LOAD)");
+
+	return p;
+}
+
+// An XSKMAP holding the socket at its queue and a program redirecting
+// the queue into it, hand assembled:
+//
+// 	r2 = ctx->rx_queue_index
+// 	r1 = map
+// 	r3 = XDP_PASS 				no socket there
+// 	return bpf_redirect_map(r1, r2, r3)
+//
+// The link created for it detaches the program when closed.
+void XdpDriver::attach(unsigned queue, bool skb)
+{
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_type = BPF_MAP_TYPE_XSKMAP;
+	a.key_size = sizeof(u_int32_t);
+	a.value_size = sizeof(u_int32_t);
+	a.max_entries = queue + 1;
+
+	if((mapfd = BPF(BPF_MAP_CREATE, &a)) == -1)
+		throw ERR("bpf(BPF_MAP_CREATE)");
+
+	u_int32_t key = queue;
+	u_int32_t val = fd;
+
+	memset(&a, 0, sizeof(a));
+
+	a.map_fd = mapfd;
+	a.key = (u_int64_t)&key;
+	a.value = (u_int64_t)&val;
+
+	if(BPF(BPF_MAP_UPDATE_ELEM, &a) == -1)
+		throw ERR("bpf(BPF_MAP_UPDATE_ELEM)");
+
+	bpf_insn prog[6];
+
+	memset(prog, 0, sizeof(prog));
+
+	prog[0].code = BPF_LDX | BPF_MEM | BPF_W;
+	prog[0].dst_reg = BPF_REG_2;
+	prog[0].src_reg = BPF_REG_1;
+	prog[0].off = offsetof(xdp_md, rx_queue_index);
+
+	prog[1].code = BPF_LD | BPF_DW | BPF_IMM;
+	prog[1].dst_reg = BPF_REG_1;
+	prog[1].src_reg = BPF_PSEUDO_MAP_FD;
+	prog[1].imm = mapfd;
+
+	prog[3].code = BPF_ALU64 | BPF_MOV | BPF_K;
+	prog[3].dst_reg = BPF_REG_3;
+	prog[3].imm = XDP_PASS;
+
+	prog[4].code = BPF_JMP | BPF_CALL;
+	prog[4].imm = BPF_FUNC_redirect_map;
+
+	prog[5].code = BPF_JMP | BPF_EXIT;
+
+	progfd = program(prog, sizeof(prog) / sizeof(prog[0]));
+
+	memset(&a, 0, sizeof(a));
+
+	a.link_create.prog_fd = progfd;
+	a.link_create.target_ifindex = ifidx;
+	a.link_create.attach_type = BPF_XDP;
+	a.link_create.flags = skb ? XDP_FLAGS_SKB_MODE : 0;
+
+	if((linkfd = BPF(BPF_LINK_CREATE, &a)) == -1)
+		throw ERR("bpf(BPF_LINK_CREATE)");
+}
+
+// The link swaps programs atomically, no frame passes the interface
+// without one.
+void XdpDriver::load(const bpf_insn *insn, size_t n)
+{
+	int p = program(insn, n);
+
+	bpf_attr a;
+
+	memset(&a, 0, sizeof(a));
+
+	a.link_update.link_fd = linkfd;
+	a.link_update.new_prog_fd = p;
+
+	if(BPF(BPF_LINK_UPDATE, &a) == -1)
+	{
+		std::string e = ERR("bpf(BPF_LINK_UPDATE)");
+
+		close(p);
+
+		throw e;
+	}
+
+	close(progfd);
+
+	progfd = p;
+}
+
+// Receive thread. The last burst is released by the receiver, frames
+// nobody holds any more go back to the fill ring.
+void XdpDriver::refill()
+{
+	for(size_t i = pending.size() - fresh; i < pending.size(); ++i)
+		__atomic_sub_fetch(umem->ref(pending[i]), 1, __ATOMIC_RELEASE);
+
+	fresh = 0;
+
+	size_t k = 0;
+	u_int32_t p = *fill.producer;
+
+	for(size_t i = 0; i < pending.size(); ++i)
+		if(__atomic_load_n(umem->ref(pending[i]), __ATOMIC_ACQUIRE) == 0)
+			ADDR(fill, p++) = umem->chunk(pending[i]);
+		else
+			pending[k++] = pending[i];
+
+	PRODUCE(fill, p - *fill.producer);
+
+	pending.resize(k);
+}
+
+// TX lock held. Own frames are free again, foreign ones sent in place are
+// released.
+void XdpDriver::reap()
+{
+	u_int32_t n = READY(comp);
+
+	for(u_int32_t i = 0; i < n; ++i)
+	{
+		u_int64_t a = ADDR(comp, *comp.consumer + i);
+
+		if(a >= txBase && a < txBase + txFrames * umem->frameLen())
+			txFree.push_back(umem->chunk(a));
+		else
+			__atomic_sub_fetch(umem->ref(a), 1, __ATOMIC_RELEASE);
+	}
+
+	CONSUME(comp, n);
+}
+
+size_t XdpDriver::recv(Frame *f, size_t n)
+{
+	refill();
+
+	u_int32_t m = READY(rx);
+
+	if(m == 0)
+	{
+		pthread_mutex_lock(&txLock);
+
+		reap();
+
+		pthread_mutex_unlock(&txLock);
+
+		pollfd p;
+
+		p.fd = fd;
+		p.events = POLLIN;
+		p.revents = 0;
+
+		if(nowait && kick)
+			recvfrom(fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		else if(nowait || poll(&p, 1, XSK_POLL) <= 0)
+			return 0;
+
+		if((m = READY(rx)) == 0)
+			return 0;
+	}
+
+	if(m > n) m = n;
+
+	for(u_int32_t i = 0; i < m; ++i)
+	{
+		const xdp_desc &d = DESC(rx, *rx.consumer + i);
+
+		f[i].data = umem->data(d.addr);
+		f[i].len = d.len;
+		f[i].ref = umem->ref(d.addr);
+
+		__atomic_store_n(f[i].ref, 1, __ATOMIC_RELAXED);
+
+		pending.push_back(d.addr);
+	}
+
+	CONSUME(rx, m);
+
+	fresh = m;
+
+	return m;
+}
+
+void XdpDriver::send(const u_int8_t *frame, size_t len)
+{
+	Frame f;
+
+	f.data = frame;
+	f.len = len;
+	f.ref = NULL;
+
+	send(&f, 1);
+}
+
+// Frames in the shared memory are sent in place and held until their
+// completion, others are copied. What does not fit is dropped.
+void XdpDriver::send(const Frame *f, size_t n)
+{
+	pthread_mutex_lock(&txLock);
+
+	reap();
+
+	u_int32_t room = ROOM(tx);
+	u_int32_t p = *tx.producer;
+
+	for(size_t i = 0; i < n && room; ++i)
+	{
+		xdp_desc &d = DESC(tx, p);
+
+		if(f[i].ref && umem->owns(f[i].data))
+		{
+			d.addr = umem->addr(f[i].data);
+
+			f[i].hold();
+		}
+		else
+		{
+			if(txFree.empty() || f[i].len > umem->frameLen())
+				continue;
+
+			d.addr = txFree.back();
+
+			txFree.pop_back();
+
+			memcpy(umem->data(d.addr), f[i].data, f[i].len);
+		}
+
+		d.len = f[i].len;
+		d.options = 0;
+
+		++p;
+		--room;
+	}
+
+	PRODUCE(tx, p - *tx.producer);
+
+	enum { KICK = 32 }; 							// frames per kick in copy mode
+
+	for(u_int32_t q = tx.mask + 1 - ROOM(tx); q; q = q > KICK ? q - KICK : 0)
+		sendto(fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+
+	reap(); 													// copy mode completes in the call
+
+	pthread_mutex_unlock(&txLock);
+}
+
+int XdpDriver::nonblock()
+{
+	nowait = true;
+
+	return fd;
+}
+
+// The socket polls its queue's NAPI context when read, so an empty
+// receive makes a syscall from now on.
+bool XdpDriver::busyPoll(unsigned usec)
+{
+	int us = usec, on = 1;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) == -1
+			|| setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == -1)
+		throw ERR("setsockopt(SO_BUSY_POLL)");
+
+	kick = true;
+
+	return true;
+}
+
+const char * XdpDriver::type() const
+{
+	return "xdp";
+}
+
+unsigned XdpDriver::ifindex() const
+{
+	return ifidx;
+}
+
+int XdpDriver::socketMap() const
+{
+	return mapfd;
+}
@@ -0,0 +1,162 @@
+//===================================================================
+// File:        xdp.h
+// Author:      Drahoslav Zan
+// Email:       izan@fit.vutbr.cz
+// Affiliation: Brno University of Technology,
+//              Faculty of Information Technology
+// Date:        Tue Apr 24 19:11:10 CET 2012
+// Comments:    AF_XDP socket backend
+// Project:     Software Ethernet Switch (SES)
+//-------------------------------------------------------------------
+// Copyright (C) 2013 Drahoslav Zan
+//
+// This file is part of SES.
+//
+// SES is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SES is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SES. If not, see <http://www.gnu.org/licenses/>.
+//===================================================================
+// vim: set nowrap sw=2 ts=2
+
+
+#ifndef _XDP_H_
+#define _XDP_H_
+
+
+#include "driver.h"
+
+#include <linux/if_xdp.h>
+#include <pthread.h>
+
+#include <vector>
+
+
+struct bpf_insn;
+
+
+#if XSK_UMEM_FRAMES <= 0
+# 	define XSK_UMEM_FRAMES 						16384 	// all ports
+#endif
+
+#if XSK_FRAME_SIZE <= 0
+# 	define XSK_FRAME_SIZE 						2048
+#endif
+
+#if XSK_RING_SIZE <= 0
+# 	define XSK_RING_SIZE 							2048
+#endif
+
+#if XSK_RX_FRAMES <= 0
+# 	define XSK_RX_FRAMES 							2048 		// per port
+#endif
+
+#if XSK_TX_FRAMES <= 0
+# 	define XSK_TX_FRAMES 							1024 		// per port
+#endif
+
+#if XSK_POLL <= 0
+# 	define XSK_POLL 									10 			// ms
+#endif
+
+
+struct XskRing
+{
+	u_int32_t *producer;
+	u_int32_t *consumer;
+	void *desc;
+	u_int32_t mask;
+	void *map;
+	size_t len;
+};
+
+// Frame memory of all AF_XDP ports, registered by the first socket and
+// shared by the others. Every frame is counted, so a frame received on
+// one port is sent from another without a copy.
+class Umem
+{
+private:
+	static Umem *um;
+private:
+	u_int8_t *area;
+	size_t frames, frameSize;
+	size_t next; 											// first not taken
+	unsigned *refs;
+	int fd;
+private:
+	Umem(size_t n, size_t size);
+public:
+	static Umem * instance(const DriverConfig &c); 	// first port sizes it
+public:
+	u_int64_t take(size_t n); 				// n frames, throws when out
+
+	u_int8_t * data(u_int64_t addr) const;
+	unsigned * ref(u_int64_t addr) const;
+	u_int64_t addr(const u_int8_t *p) const;
+	u_int64_t chunk(u_int64_t addr) const;
+	bool owns(const u_int8_t *p) const;
+
+	size_t size() const;
+	size_t frameLen() const;
+	int socket() const;
+	void setSocket(int s);
+};
+
+// One socket on one queue of the interface, an XDP program redirects the
+// queue to it. Received frames go back to the fill ring once nobody holds
+// them, sends of foreign frames are copied into the port's TX frames.
+// The program may be replaced by one doing more, it must still redirect
+// what it leaves to userspace into socketMap().
+class XdpDriver : public Driver
+{
+private:
+	Umem *umem;
+	int fd, mapfd, progfd, linkfd;
+	unsigned ifidx;
+	XskRing fill, comp, rx, tx;
+private:
+	std::vector<u_int64_t> pending; 	// delivered, not refilled
+	size_t fresh; 										// from the last recv()
+	bool nowait;
+	bool kick; 												// recv() enters the kernel
+private:
+	pthread_mutex_t txLock;
+	u_int64_t txBase;
+	size_t txFrames;
+	std::vector<u_int64_t> txFree;
+private:
+	void shut();
+	void ring(XskRing &r, size_t n, const xdp_ring_offset &o, off_t pgoff,
+			size_t esize);
+	int program(const bpf_insn *insn, size_t n);
+	void attach(unsigned queue, bool skb);
+	void refill();
+	void reap();
+public:
+	XdpDriver(const char *ifname, const DriverConfig &c);
+	~XdpDriver();
+
+	size_t recv(Frame *f, size_t n);
+	void send(const u_int8_t *frame, size_t len);
+	void send(const Frame *f, size_t n);
+
+	int nonblock();
+	bool busyPoll(unsigned usec);
+
+	const char *type() const;
+
+	unsigned ifindex() const;
+	int socketMap() const;
+	void load(const bpf_insn *insn, size_t n); 	// throws, keeps the old one
+};
+
+
+#endif /* _XDP_H_ */